@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,33 +7,126 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 
 #define SERVER_PORT 8080
+#define SERVER_UNIX_SOCKET "/tmp/fileserver.sock"
+#define MIRROR_PORT 8081
+#define MIRROR_UNIX_SOCKET "/tmp/fileserver_mirror.sock"
+#define SPLIT_SHARDS 2
 #define MAX_BUFFER 4096
 #define MAX_COMMAND 512
+#define MAX_BUSY_RETRIES 5
+#define MAX_TAG 32
+#define CACHE_DIR ".fscache"
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (1 << 17)
+#define DELTA_MAX_LITERAL 65536
+#define STREAM_ABORT 0xffffffffU
+
+// Flags accepted after any command, forwarded as request option lines
+struct client_flag {
+    char *flag;
+    char *option;
+    int takes_value;
+};
+
+struct client_flag client_flags[] = {
+    {"--dedup", "DEDUP", 0},
+    {"--exclude", "EXCLUDE", 1},
+    {"--maxdepth", "MAXDEPTH", 1},
+    {"--nohidden", "NOHIDDEN", 0},
+    {"--xdev", "XDEV", 0},
+    {"--timeout", "DEADLINE", 1},
+    {"--all", "ALL", 0},
+    {"--limit", "LIMIT", 1},
+};
+
+// Client-side flags: where to unpack the archive as it arrives
+char extract_dir[MAX_COMMAND];
+int extract_sync = 0;
+int split_request = 0;
+
+// Set once the server has handed us to the mirror
+int on_mirror = 0;
+
+// Where the last connection went, to start over after a broken transfer
+char peer_address[MAX_COMMAND];
+int peer_port = 0;
+
+// "tar -cf - -T /dev/null | gzip -n": closes a joined split archive whose
+// last shard came back empty
+unsigned char gzip_tar_trailer[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x63, 0x60,
+    0x18, 0x05, 0xa3, 0x60, 0x14, 0x8c, 0x54, 0x00, 0x00, 0x2e, 0xaf, 0xb5,
+    0xef, 0x00, 0x04, 0x00, 0x00
+};
 
 // Function prototypes
 int connect_to_server(char *server_ip, int port);
 int validate_command(char *command);
 void send_command(int socket, char *command);
 void receive_response(int socket);
-void receive_file(int socket, char *filename);
+int receive_file(int socket, char *filename, long file_size, int extract_fd);
+int receive_file_fd(int socket, char *filename, long file_size);
+int receive_stream(int socket, char *filename, int extract_fd);
+int receive_matches(int socket, char *received, int len);
+void print_job_reply(char *response);
+int is_archive_command(char *command);
+void archive_filename(char *command, char *filename);
+int split_flags(char *command, char *options, size_t size);
+void build_request(char *command, char *options, char *cache_key, char *request, size_t size);
+void cache_path(char *command, char *suffix, char *path, size_t size);
+int read_cached_tag(char *command, char *tag);
+void store_in_cache(char *command, char *filename, char *tag);
+int copy_file(char *src, char *dst);
+int start_extract(char *dir, pid_t *pid);
+int finish_extract(int extract_fd, pid_t pid, char *dir);
+int extract_archive(char *filename, char *dir);
+int write_all(int fd, char *buffer, size_t len);
+unsigned long hash_bytes(unsigned long hash, void *data, size_t len);
+int recv_all(int socket, void *buffer, size_t len);
+unsigned int get_u32(unsigned char *p);
+void put_u32(unsigned char *p, unsigned int value);
+int send_signatures(int socket, char *basis, int block_size);
+int receive_delta(int socket, char *basis, char *filename);
 int is_valid_date(char *date);
 int is_valid_size(char *size_str);
 int is_valid_extension(char *ext);
 void print_usage();
 void handle_redirect(int socket);
+int fetch_split(int *socket, char *command, char *options);
+int fetch_shard(int *socket, char *request, char *filename);
+int follow_redirect(int *socket, char *response);
+int reconnect(int *socket);
+int append_file(char *src, FILE *out);
 
 int main() {
-    int client_socket;
+    int client_socket = -1;
     char command[MAX_COMMAND];
     char server_ip[] = "127.0.0.1";
     
     printf("=== File Server Client ===\n");
-    printf("Connecting to server at %s:%d\n", server_ip, SERVER_PORT);
+    
+    // A failed extractor must surface as an error, not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Prefer the server's UNIX socket when it runs on this host and lets us in
+    if (access(SERVER_UNIX_SOCKET, W_OK) == 0) {
+        printf("Connecting to server at %s\n", SERVER_UNIX_SOCKET);
+        client_socket = connect_to_server(SERVER_UNIX_SOCKET, 0);
+    }
     
     // Connect to server
-    client_socket = connect_to_server(server_ip, SERVER_PORT);
+    if (client_socket < 0) {
+        printf("Connecting to server at %s:%d\n", server_ip, SERVER_PORT);
+        client_socket = connect_to_server(server_ip, SERVER_PORT);
+    }
     if (client_socket < 0) {
         printf("Failed to connect to server\n");
         return 1;
@@ -41,17 +135,24 @@ int main() {
     printf("Connected to server successfully!\n");
     print_usage();
     
+    char retry_command[MAX_COMMAND] = "";
     while (1) {
-        printf("\nEnter command (or 'quit' to exit): ");
-        fflush(stdout);
-        
-        if (fgets(command, sizeof(command), stdin) == NULL) {
-            break;
+        if (retry_command[0]) {
+            // Repeat a command whose delta broke, now as a full download
+            snprintf(command, sizeof(command), "%s", retry_command);
+            retry_command[0] = '\0';
+        } else {
+            printf("\nEnter command (or 'quit' to exit): ");
+            fflush(stdout);
+            
+            if (fgets(command, sizeof(command), stdin) == NULL) {
+                break;
+            }
+            
+            // Remove newline character
+            command[strcspn(command, "\n")] = 0;
         }
         
-        // Remove newline character
-        command[strcspn(command, "\n")] = 0;
-        
         // Skip empty commands
         if (strlen(command) == 0) {
             continue;
@@ -63,14 +164,37 @@ int main() {
             break;
         }
         
+        // Pull --flags out of the command; they travel as option lines
+        char raw_command[MAX_COMMAND];
+        snprintf(raw_command, sizeof(raw_command), "%s", command);
+        char options[MAX_COMMAND];
+        if (split_flags(command, options, sizeof(options)) < 0) {
+            continue;
+        }
+        
         // Validate command syntax
         if (!validate_command(command)) {
             printf("Invalid command syntax. Type 'help' for usage information.\n");
             continue;
         }
         
-        // Send command to server
-        send_command(client_socket, command);
+        // --split: both servers build half of the archive at once
+        if (split_request) {
+            if (fetch_split(&client_socket, command, options) < 0) {
+                printf("Connection lost to server\n");
+                break;
+            }
+            continue;
+        }
+        
+        // Results differ per flag set, so flags are part of the cache key
+        char cache_key[2 * MAX_COMMAND];
+        snprintf(cache_key, sizeof(cache_key), "%s%s", command, options);
+        
+        // Send command to server, with the cached tag for archive commands
+        char request[2 * MAX_COMMAND + 64];
+        build_request(command, options, cache_key, request, sizeof(request));
+        send_command(client_socket, request);
         
         // Handle server response
         char response[MAX_BUFFER];
@@ -85,25 +209,12 @@ int main() {
         
         // Check for redirect message
         if (strncmp(response, "REDIRECT", 8) == 0) {
-            printf("Server is redirecting to mirror server...\n");
-            close(client_socket);
-            
-            // Parse redirect message
-            char mirror_ip[64];
-            int mirror_port;
-            sscanf(response, "REDIRECT %s %d", mirror_ip, &mirror_port);
-            
-            // Connect to mirror server
-            client_socket = connect_to_server(mirror_ip, mirror_port);
-            if (client_socket < 0) {
-                printf("Failed to connect to mirror server\n");
+            if (follow_redirect(&client_socket, response) < 0) {
                 break;
             }
             
-            printf("Connected to mirror server at %s:%d\n", mirror_ip, mirror_port);
-            
             // Resend the command to mirror server
-            send_command(client_socket, command);
+            send_command(client_socket, request);
             bytes_received = recv(client_socket, response, sizeof(response) - 1, 0);
             if (bytes_received <= 0) {
                 printf("Connection lost to mirror server\n");
@@ -112,47 +223,174 @@ int main() {
             response[bytes_received] = '\0';
         }
         
-        // Handle different types of responses
-        if (strncmp(command, "findfile", 8) == 0) {
-            if (strcmp(response, "File not found") == 0) {
+        // Server is saturated: wait as long as it asks, then resend
+        for (int attempt = 0; attempt < MAX_BUSY_RETRIES && strncmp(response, "BUSY", 4) == 0; attempt++) {
+            int retry_ms = 0;
+            sscanf(response, "BUSY retry after %d ms", &retry_ms);
+            printf("Server busy, retrying in %d ms...\n", retry_ms);
+            usleep(retry_ms * 1000);
+            
+            send_command(client_socket, request);
+            bytes_received = recv(client_socket, response, sizeof(response) - 1, 0);
+            if (bytes_received <= 0) {
+                break;
+            }
+            response[bytes_received] = '\0';
+        }
+        
+        if (bytes_received <= 0) {
+            printf("Connection lost to server\n");
+            break;
+        }
+        if (strncmp(response, "BUSY", 4) == 0) {
+            printf("Server is still busy, try again later\n");
+            continue;
+        }
+        
+        // The server gave up once the --timeout deadline passed
+        if (strcmp(response, "Error: deadline exceeded") == 0) {
+            printf("Request timed out on the server\n");
+            continue;
+        }
+        
+        // Handle different types of responses; job commands (and fetching
+        // an unfinished job) are answered with "JOB <id> <state>"
+        if (strncmp(response, "JOB ", 4) == 0) {
+            print_job_reply(response);
+        }
+        else if (strncmp(command, "findfile", 8) == 0) {
+            if (strncmp(response, "MATCH ", 6) == 0 || strncmp(response, "END ", 4) == 0) {
+                // --all / --limit: matches arrive one per line as they are found
+                if (receive_matches(client_socket, response, bytes_received) < 0) {
+                    printf("Connection lost to server\n");
+                    break;
+                }
+            } else if (strcmp(response, "File not found") == 0) {
                 printf("File not found\n");
             } else {
                 printf("File found at: %s\n", response);
             }
         }
-        else if (strncmp(command, "getftar", 7) == 0 || 
-                 strncmp(command, "sgetfiles", 9) == 0 ||
-                 strncmp(command, "dgetfiles", 9) == 0 ||
-                 strncmp(command, "getfiles", 8) == 0) {
+        else if (strncmp(command, "estimate ", 9) == 0) {
+            int files = 0;
+            long bytes = 0, archive = 0;
+            char truncated[16] = "";
+            if (sscanf(response, "ESTIMATE %d %ld %ld %15s", &files, &bytes, &archive, truncated) >= 3) {
+                printf("%d file%s, %ld bytes uncompressed, archive about %ld bytes\n",
+                       files, files == 1 ? "" : "s", bytes, archive);
+                if (truncated[0]) {
+                    printf("Note: more files match; an archive holds at most %d\n", files);
+                }
+            } else if (strcmp(response, "No file found") == 0) {
+                printf("No files found matching the criteria\n");
+            } else {
+                printf("Server response: %s\n", response);
+            }
+        }
+        else if (is_archive_command(command)) {
+            char filename[64];
+            archive_filename(command, filename);
             
             if (strcmp(response, "No file found") == 0) {
                 printf("No files found matching the criteria\n");
             } else if (strncmp(response, "Error", 5) == 0) {
                 printf("Server error: %s\n", response);
+            } else if (strncmp(response, "DELTA", 5) == 0) {
+                // Server wants signatures of our cached copy, then sends only changes
+                char tag[MAX_TAG] = "";
+                char cached[MAX_COMMAND];
+                sscanf(response, "DELTA %31s", tag);
+                cache_path(cache_key, ".tar.gz", cached, sizeof(cached));
+                if (receive_delta(client_socket, cached, filename) == 0) {
+                    printf("File saved as: %s\n", filename);
+                    store_in_cache(cache_key, filename, tag);
+                    if (extract_dir[0]) extract_archive(filename, extract_dir);
+                } else {
+                    // The connection is left mid-transfer: drop the cached
+                    // copy and its tag, then ask again on a new connection
+                    printf("Delta transfer failed, retrying as a full download\n");
+                    unlink(cached);
+                    cache_path(cache_key, ".tag", cached, sizeof(cached));
+                    unlink(cached);
+                    if (reconnect(&client_socket) < 0) {
+                        printf("Connection lost to server\n");
+                        break;
+                    }
+                    snprintf(retry_command, sizeof(retry_command), "%s", raw_command);
+                }
+            } else if (strncmp(response, "STREAM", 6) == 0) {
+                // Sent while the server is still building it, size unknown
+                char tag[MAX_TAG] = "";
+                sscanf(response, "STREAM %31s", tag);
+                printf("Receiving file (streamed)...\n");
+                send(client_socket, "ACK", 3, 0);
+                
+                pid_t extract_pid = -1;
+                int extract_fd = -1;
+                if (extract_dir[0]) {
+                    extract_fd = start_extract(extract_dir, &extract_pid);
+                }
+                
+                int received = receive_stream(client_socket, filename, extract_fd);
+                if (received == 0) {
+                    printf("File saved as: %s\n", filename);
+                    store_in_cache(cache_key, filename, tag);
+                }
+                if (extract_fd >= 0) {
+                    finish_extract(extract_fd, extract_pid, extract_dir);
+                }
+                if (received == -2) {
+                    // The stream can't be resynchronised after a bad frame
+                    break;
+                }
+            } else if (strncmp(response, "Not modified", 12) == 0) {
+                char cached[MAX_COMMAND];
+                cache_path(cache_key, ".tar.gz", cached, sizeof(cached));
+                if (copy_file(cached, filename) == 0) {
+                    printf("Not modified since last download, using cached copy\n");
+                    printf("File saved as: %s\n", filename);
+                    if (extract_dir[0]) extract_archive(filename, extract_dir);
+                } else {
+                    // Without its tag the command is sent again in full
+                    printf("Error: cached copy is missing, retrying as a full download\n");
+                    cache_path(cache_key, ".tag", cached, sizeof(cached));
+                    unlink(cached);
+                    snprintf(retry_command, sizeof(retry_command), "%s", raw_command);
+                }
             } else {
-                // Response should be file size
-                long file_size = atol(response);
+                // Response should be "<file size> <content tag> [FD]"
+                long file_size = 0;
+                char tag[MAX_TAG] = "";
+                char transfer[8] = "";
+                sscanf(response, "%ld %31s %7s", &file_size, tag, transfer);
                 if (file_size > 0) {
                     printf("Receiving file (%ld bytes)...\n", file_size);
                     
                     // Send acknowledgment
                     send(client_socket, "ACK", 3, 0);
                     
-                    // Generate filename based on command
-                    char filename[64];
-                    if (strncmp(command, "getftar", 7) == 0) {
-                        strcpy(filename, "file.tar.gz");
-                    } else if (strncmp(command, "sgetfiles", 9) == 0) {
-                        strcpy(filename, "sizefiles.tar.gz");
-                    } else if (strncmp(command, "dgetfiles", 9) == 0) {
-                        strcpy(filename, "datefiles.tar.gz");
-                    } else {
-                        strcpy(filename, "files.tar.gz");
+                    // A streamed archive is unpacked while it downloads
+                    int local = strcmp(transfer, "FD") == 0;
+                    pid_t extract_pid = -1;
+                    int extract_fd = -1;
+                    if (extract_dir[0] && !local) {
+                        extract_fd = start_extract(extract_dir, &extract_pid);
                     }
                     
-                    // Receive the file
-                    receive_file(client_socket, filename);
-                    printf("File saved as: %s\n", filename);
+                    // Receive the file: as a passed descriptor from a local
+                    // server, otherwise as a byte stream
+                    int received = local
+                        ? receive_file_fd(client_socket, filename, file_size)
+                        : receive_file(client_socket, filename, file_size, extract_fd);
+                    if (received == 0) {
+                        printf("File saved as: %s\n", filename);
+                        store_in_cache(cache_key, filename, tag);
+                    }
+                    if (extract_fd >= 0) {
+                        finish_extract(extract_fd, extract_pid, extract_dir);
+                    } else if (received == 0 && extract_dir[0]) {
+                        extract_archive(filename, extract_dir);
+                    }
                 } else {
                     printf("Invalid file size received\n");
                 }
@@ -172,6 +410,31 @@ int connect_to_server(char *server_ip, int port) {
     int client_socket;
     struct sockaddr_in server_addr;
     
+    // Same-host servers listen on a UNIX socket path
+    if (server_ip[0] == '/') {
+        struct sockaddr_un unix_addr;
+        
+        client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client_socket < 0) {
+            perror("Socket creation failed");
+            return -1;
+        }
+        
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        snprintf(unix_addr.sun_path, sizeof(unix_addr.sun_path), "%s", server_ip);
+        
+        if (connect(client_socket, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
+            perror("Connection failed");
+            close(client_socket);
+            return -1;
+        }
+        
+        snprintf(peer_address, sizeof(peer_address), "%s", server_ip);
+        peer_port = 0;
+        return client_socket;
+    }
+    
     // Create socket
     client_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (client_socket < 0) {
@@ -191,6 +454,8 @@ int connect_to_server(char *server_ip, int port) {
         return -1;
     }
     
+    snprintf(peer_address, sizeof(peer_address), "%s", server_ip);
+    peer_port = port;
     return client_socket;
 }
 
@@ -200,6 +465,53 @@ int validate_command(char *command) {
         return 0; // Don't send to server
     }
     
+    // estimate <archive command>: same syntax as the command it sizes
+    if (strncmp(command, "estimate ", 9) == 0) {
+        if (!is_archive_command(command + 9) || strncmp(command + 9, "fetch ", 6) == 0) {
+            printf("Error: estimate syntax is 'estimate <sgetfiles|dgetfiles|getfiles|getftar> ...'\n");
+            return 0;
+        }
+        return validate_command(command + 9);
+    }
+    
+    // submit <archive command>: built in the background as a job
+    if (strncmp(command, "submit ", 7) == 0) {
+        if (!is_archive_command(command + 7) || strncmp(command + 7, "fetch ", 6) == 0) {
+            printf("Error: submit syntax is 'submit <sgetfiles|dgetfiles|getfiles|getftar> ...'\n");
+            return 0;
+        }
+        return validate_command(command + 7);
+    }
+    
+    // status|fetch|cancel <job id>
+    if (strncmp(command, "status", 6) == 0 || strncmp(command, "fetch", 5) == 0 ||
+        strncmp(command, "cancel", 6) == 0) {
+        char verb[16], id[64];
+        if (sscanf(command, "%15s %63s", verb, id) == 2) {
+            return 1;
+        }
+        printf("Error: syntax is '%s <job id>'\n", strncmp(command, "fetch", 5) == 0 ? "fetch" : verb);
+        return 0;
+    }
+    
+    // stats: server counters, printed as the server sends them
+    if (strcmp(command, "stats") == 0) {
+        return 1;
+    }
+    
+    // ratelimit [<per connection> <per client> <total>], in KB/s
+    if (strncmp(command, "ratelimit", 9) == 0) {
+        char conn[32], ip[32], total[32];
+        int args = sscanf(command, "ratelimit %31s %31s %31s", conn, ip, total);
+        if (strcmp(command, "ratelimit") == 0 ||
+            (args == 3 && is_valid_size(conn) && is_valid_size(ip) && is_valid_size(total))) {
+            return 1;
+        }
+        printf("Error: ratelimit syntax is 'ratelimit [<per connection> <per client> <total>]'\n");
+        printf("Note: limits are in KB/s, 0 means unlimited\n");
+        return 0;
+    }
+    
     // findfile <filename>
     if (strncmp(command, "findfile", 8) == 0) {
         char filename[256];
@@ -249,7 +561,11 @@ int validate_command(char *command) {
     if (strncmp(command, "getfiles", 8) == 0) {
         char extensions[6][16];
         int ext_count = 0;
-        char *token = strtok(command + 9, " ");
+        char args[MAX_COMMAND];
+        
+        // Tokenize a copy so the command sent to the server stays intact
+        snprintf(args, sizeof(args), "%s", command + 8);
+        char *token = strtok(args, " ");
         
         while (token != NULL && ext_count < 6) {
             if (is_valid_extension(token)) {
@@ -289,41 +605,450 @@ int validate_command(char *command) {
 }
 
 void send_command(int socket, char *command) {
-    send(socket, command, strlen(command), 0);
+    // A UNIX peer that already redirected us has closed its end; the
+    // REDIRECT is still queued for recv, so don't die on SIGPIPE here
+    send(socket, command, strlen(command), MSG_NOSIGNAL);
 }
 
-void receive_file(int socket, char *filename) {
+int receive_file(int socket, char *filename, long file_size, int extract_fd) {
     FILE *file = fopen(filename, "wb");
     if (file == NULL) {
         printf("Error: Cannot create file %s\n", filename);
-        return;
+        return -1;
     }
     
     char buffer[MAX_BUFFER];
-    int bytes_received;
-    int total_received = 0;
+    int bytes_received = 0;
+    long total_received = 0;
+    long next_dot = MAX_BUFFER * 10;
     
     printf("Downloading");
     fflush(stdout);
     
-    while ((bytes_received = recv(socket, buffer, sizeof(buffer), 0)) > 0) {
+    // Read exactly the advertised size; a short recv() is not the end
+    while (total_received < file_size) {
+        long want = file_size - total_received;
+        if (want > (long)sizeof(buffer)) want = sizeof(buffer);
+        
+        bytes_received = recv(socket, buffer, want, 0);
+        if (bytes_received <= 0) {
+            break;
+        }
         fwrite(buffer, 1, bytes_received, file);
         total_received += bytes_received;
         
+        // Feed the extractor too; if it dies, keep downloading and report it at the end
+        if (extract_fd >= 0 && write_all(extract_fd, buffer, bytes_received) < 0) {
+            extract_fd = -1;
+        }
+        
         // Print progress dots
-        if (total_received % (MAX_BUFFER * 10) == 0) {
+        if (total_received >= next_dot) {
             printf(".");
             fflush(stdout);
+            next_dot += MAX_BUFFER * 10;
+        }
+    }
+    
+    fclose(file);
+    if (total_received < file_size) {
+        printf(" Failed! (connection closed after %ld of %ld bytes)\n", total_received, file_size);
+        unlink(filename);
+        return -1;
+    }
+    
+    printf(" Complete!\n");
+    return 0;
+}
+
+// Take the archive descriptor passed with SCM_RIGHTS and copy it in-kernel
+int receive_file_fd(int socket, char *filename, long file_size) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    char marker;
+    char control[CMSG_SPACE(sizeof(int))];
+    int archive_fd = -1;
+    
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    if (recvmsg(socket, &msg, 0) <= 0) {
+        printf("Error: connection lost while receiving file\n");
+        return -1;
+    }
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&archive_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (archive_fd < 0) {
+        printf("Error: server did not pass the archive\n");
+        return -1;
+    }
+    
+    int out_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("Error: Cannot create file %s\n", filename);
+        close(archive_fd);
+        return -1;
+    }
+    
+    off_t offset = 0;
+    while (offset < file_size) {
+        if (sendfile(out_fd, archive_fd, &offset, file_size - offset) <= 0) {
+            break;
+        }
+    }
+    close(archive_fd);
+    close(out_fd);
+    
+    if (offset < file_size) {
+        printf("Error: copied %ld of %ld bytes\n", (long)offset, file_size);
+        unlink(filename);
+        return -1;
+    }
+    
+    printf("Received local file handle, copied %ld bytes\n", (long)offset);
+    return 0;
+}
+
+int is_archive_command(char *command) {
+    return strncmp(command, "getftar", 7) == 0 ||
+           strncmp(command, "fetch ", 6) == 0 ||
+           strncmp(command, "sgetfiles", 9) == 0 ||
+           strncmp(command, "dgetfiles", 9) == 0 ||
+           strncmp(command, "getfiles", 8) == 0;
+}
+
+// Generate the output filename based on command
+void archive_filename(char *command, char *filename) {
+    if (strncmp(command, "getftar", 7) == 0) {
+        strcpy(filename, "file.tar.gz");
+    } else if (strncmp(command, "fetch ", 6) == 0) {
+        snprintf(filename, 64, "job_%.32s.tar.gz", command + 6);
+    } else if (strncmp(command, "sgetfiles", 9) == 0) {
+        strcpy(filename, "sizefiles.tar.gz");
+    } else if (strncmp(command, "dgetfiles", 9) == 0) {
+        strcpy(filename, "datefiles.tar.gz");
+    } else {
+        strcpy(filename, "files.tar.gz");
+    }
+}
+
+// Move "--flag [value]" tokens out of command into "\nOPTION [value]" lines
+int split_flags(char *command, char *options, size_t size) {
+    char words[MAX_COMMAND];
+    int command_len = 0, options_len = 0;
+    
+    snprintf(words, sizeof(words), "%s", command);
+    command[0] = '\0';
+    options[0] = '\0';
+    extract_dir[0] = '\0';
+    extract_sync = 0;
+    split_request = 0;
+    
+    for (char *token = strtok(words, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (strncmp(token, "--", 2) != 0) {
+            command_len += snprintf(command + command_len, MAX_COMMAND - command_len,
+                                    command_len ? " %s" : "%s", token);
+            continue;
+        }
+        
+        // Client-side flags change how the reply is stored, not the request
+        if (strcmp(token, "--extract") == 0) {
+            char *value = strtok(NULL, " ");
+            if (value == NULL) {
+                printf("Error: %s needs a value\n", token);
+                return -1;
+            }
+            snprintf(extract_dir, sizeof(extract_dir), "%s", value);
+            continue;
+        }
+        if (strcmp(token, "--sync") == 0) {
+            extract_sync = 1;
+            continue;
+        }
+        if (strcmp(token, "--split") == 0) {
+            split_request = 1;
+            continue;
+        }
+        
+        int known = 0;
+        for (int i = 0; i < (int)(sizeof(client_flags) / sizeof(client_flags[0])); i++) {
+            if (strcmp(token, client_flags[i].flag) != 0) continue;
+            
+            known = 1;
+            options_len += snprintf(options + options_len, size - options_len, "\n%s", client_flags[i].option);
+            if (client_flags[i].takes_value) {
+                char *value = strtok(NULL, " ");
+                if (value == NULL) {
+                    printf("Error: %s needs a value\n", token);
+                    return -1;
+                }
+                options_len += snprintf(options + options_len, size - options_len, " %s", value);
+            }
+        }
+        if (!known) {
+            printf("Error: unknown flag '%s'\n", token);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Command line plus option lines; archive commands carry the tag of the
+// cached copy so the server can answer "Not modified"
+void build_request(char *command, char *options, char *cache_key, char *request, size_t size) {
+    char tag[MAX_TAG];
+    int len = snprintf(request, size, "%s%s", command, options);
+    
+    if (is_archive_command(command) && read_cached_tag(cache_key, tag) == 0) {
+        len += snprintf(request + len, size - len, "\nIF-NONE-MATCH %s", tag);
+        // With a previous copy on disk a changed result is sent as a delta
+        len += snprintf(request + len, size - len, "\nDELTA");
+    }
+    // Otherwise take the archive as it is built rather than after
+    if (is_archive_command(command)) {
+        snprintf(request + len, size - len, "\nSTREAM");
+    }
+}
+
+// Cache entries are named after an FNV-1a hash of the command
+void cache_path(char *command, char *suffix, char *path, size_t size) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    for (char *p = command; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211UL;
+    }
+    
+    snprintf(path, size, "%s/%016lx%s", CACHE_DIR, hash, suffix);
+}
+
+int read_cached_tag(char *command, char *tag) {
+    char path[MAX_COMMAND];
+    cache_path(command, ".tag", path, sizeof(path));
+    
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    
+    int found = fscanf(file, "%31s", tag) == 1;
+    fclose(file);
+    return found ? 0 : -1;
+}
+
+void store_in_cache(char *command, char *filename, char *tag) {
+    char archive_path[MAX_COMMAND], tag_path[MAX_COMMAND];
+    
+    if (strlen(tag) == 0) return;
+    
+    mkdir(CACHE_DIR, 0755);
+    cache_path(command, ".tar.gz", archive_path, sizeof(archive_path));
+    cache_path(command, ".tag", tag_path, sizeof(tag_path));
+    
+    if (copy_file(filename, archive_path) < 0) {
+        return;
+    }
+    
+    FILE *file = fopen(tag_path, "w");
+    if (file != NULL) {
+        fprintf(file, "%s\n", tag);
+        fclose(file);
+    }
+}
+
+int copy_file(char *src, char *dst) {
+    FILE *in = fopen(src, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+    
+    FILE *out = fopen(dst, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+    
+    char buffer[MAX_BUFFER];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        fwrite(buffer, 1, n, out);
+    }
+    
+    fclose(in);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+// FNV-1a, continued from hash
+unsigned long hash_bytes(unsigned long hash, void *data, size_t len) {
+    unsigned char *p = data;
+    
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211UL;
+    }
+    
+    return hash;
+}
+
+int recv_all(int socket, void *buffer, size_t len) {
+    char *p = buffer;
+    
+    while (len > 0) {
+        ssize_t n = recv(socket, p, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+unsigned int get_u32(unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+void put_u32(unsigned char *p, unsigned int value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Send u32 count, u32 block size, then (weak, strong) for every full block
+int send_signatures(int socket, char *basis, int block_size) {
+    FILE *file = fopen(basis, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    unsigned int count = size / block_size;
+    unsigned char *sigs = malloc(8 + 12 * (size_t)count);
+    unsigned char *block = malloc(block_size);
+    if (sigs == NULL || block == NULL) {
+        free(sigs);
+        free(block);
+        fclose(file);
+        return -1;
+    }
+    
+    put_u32(sigs, count);
+    put_u32(sigs + 4, block_size);
+    for (unsigned int i = 0; i < count; i++) {
+        if (fread(block, 1, block_size, file) != (size_t)block_size) {
+            count = i;
+            put_u32(sigs, count);
+            break;
+        }
+        
+        // Same rolling sum the server slides over the new archive
+        unsigned int a = 0, b = 0;
+        for (int j = 0; j < block_size; j++) {
+            a += block[j];
+            b += (unsigned int)(block_size - j) * block[j];
         }
+        unsigned long strong = hash_bytes(1469598103934665603UL, block, block_size);
         
-        // Check if we've received all data (this is a simple approach)
-        if (bytes_received < MAX_BUFFER) {
+        put_u32(sigs + 8 + 12 * i, (a & 0xffff) | (b << 16));
+        put_u32(sigs + 12 + 12 * i, strong >> 32);
+        put_u32(sigs + 16 + 12 * i, strong);
+    }
+    fclose(file);
+    free(block);
+    
+    size_t len = 8 + 12 * (size_t)count;
+    int status = send(socket, sigs, len, 0) == (ssize_t)len ? 0 : -1;
+    free(sigs);
+    return status;
+}
+
+// Rebuild filename from our cached basis plus the server's copy/literal records
+int receive_delta(int socket, char *basis, char *filename) {
+    FILE *base = fopen(basis, "rb");
+    if (base == NULL) {
+        printf("Error: cached copy is missing\n");
+        return -1;
+    }
+    fseek(base, 0, SEEK_END);
+    long base_size = ftell(base);
+    
+    // About sqrt(size) per block, as rsync does
+    int block_size = DELTA_MIN_BLOCK;
+    while (block_size < DELTA_MAX_BLOCK && (long)block_size * block_size < base_size) {
+        block_size *= 2;
+    }
+    
+    FILE *out = fopen(filename, "wb");
+    char *buffer = malloc(DELTA_MAX_LITERAL > block_size ? DELTA_MAX_LITERAL : block_size);
+    if (out == NULL || buffer == NULL || send_signatures(socket, basis, block_size) < 0) {
+        printf("Error: cannot start delta transfer\n");
+        if (out != NULL) fclose(out);
+        free(buffer);
+        fclose(base);
+        return -1;
+    }
+    
+    printf("Receiving changes against cached copy");
+    fflush(stdout);
+    
+    unsigned long hash = 1469598103934665603UL;
+    long total = 0, literal_bytes = 0, copied_blocks = 0;
+    int status = -1;
+    unsigned char op[17];
+    
+    while (recv_all(socket, op, 1) == 0) {
+        if (op[0] == 'C' && recv_all(socket, op + 1, 4) == 0) {
+            unsigned int index = get_u32(op + 1);
+            fseek(base, (long)index * block_size, SEEK_SET);
+            if (fread(buffer, 1, block_size, base) != (size_t)block_size) break;
+            fwrite(buffer, 1, block_size, out);
+            hash = hash_bytes(hash, buffer, block_size);
+            total += block_size;
+            copied_blocks++;
+        } else if (op[0] == 'L' && recv_all(socket, op + 1, 4) == 0) {
+            unsigned int len = get_u32(op + 1);
+            if (len > DELTA_MAX_LITERAL || recv_all(socket, buffer, len) < 0) break;
+            fwrite(buffer, 1, len, out);
+            hash = hash_bytes(hash, buffer, len);
+            total += len;
+            literal_bytes += len;
+        } else if (op[0] == 'E' && recv_all(socket, op + 1, 16) == 0) {
+            long size = ((long)get_u32(op + 1) << 32) | get_u32(op + 5);
+            unsigned long expected = ((unsigned long)get_u32(op + 9) << 32) | get_u32(op + 13);
+            status = (size == total && expected == hash) ? 0 : -1;
+            break;
+        } else {
             break;
         }
     }
     
+    fclose(out);
+    fclose(base);
+    free(buffer);
+    
+    if (status < 0) {
+        printf(" Failed! (delta did not reproduce the server's archive)\n");
+        unlink(filename);
+        return -1;
+    }
+    
     printf(" Complete!\n");
-    fclose(file);
+    printf("Delta: %ld new bytes, %ld cached blocks reused (%ld bytes total)\n",
+           literal_bytes, copied_blocks, total);
+    return 0;
 }
 
 int is_valid_date(char *date) {
@@ -378,13 +1103,447 @@ void print_usage() {
     printf("dgetfiles <date1> <date2>        - Get files within date range (YYYY-MM-DD)\n");
     printf("getfiles <ext1> [ext2] ... [ext6] - Get files by extensions (1-6 extensions)\n");
     printf("getftar <filename>               - Get a specific file as tar\n");
+    printf("estimate <command>               - Count and size an archive command's result\n");
+    printf("submit <command>                 - Build an archive command's result in the background\n");
+    printf("status <job id>                  - Show a submitted job's state\n");
+    printf("fetch <job id>                   - Download a finished job's archive\n");
+    printf("cancel <job id>                  - Cancel a submitted job\n");
+    printf("stats                            - Show server index and lookup counters\n");
+    printf("ratelimit [<conn> <client> <total>] - Show or set send limits in KB/s (local only)\n");
     printf("quit                             - Exit the client\n");
     printf("help                             - Show this help message\n");
+    printf("\nFlags (after a command):\n");
+    printf("  --dedup                        - Store identical files once (hard links)\n");
+    printf("  --exclude <glob>               - Skip files and directories named <glob>\n");
+    printf("  --maxdepth <n>                 - Look at most <n> levels below home\n");
+    printf("  --nohidden                     - Skip names starting with '.'\n");
+    printf("  --xdev                         - Stay on the home directory's filesystem\n");
+    printf("  --timeout <ms>                 - Let the server give up after <ms> milliseconds\n");
+    printf("  --all                          - findfile: list every match as it is found\n");
+    printf("  --limit <n>                    - findfile: stop after <n> matches\n");
+    printf("  --extract <dir>                - Unpack into <dir> while downloading\n");
+    printf("  --sync                         - With --extract, flush <dir> to disk at the end\n");
+    printf("  --split                        - Fetch half the archive from each server at once\n");
     printf("\nExamples:\n");
     printf("  findfile document.txt\n");
+    printf("  findfile notes.txt --limit 10\n");
     printf("  sgetfiles 1024 10485760\n");
     printf("  dgetfiles 2023-01-01 2023-12-31\n");
     printf("  getfiles txt pdf\n");
+    printf("  sgetfiles 0 100000000 --split\n");
     printf("  getftar config.conf\n");
+    printf("  estimate sgetfiles 0 100000000\n");
+    printf("  submit dgetfiles 2020-01-01 2023-12-31\n");
     printf("==========================\n");
-}
\ No newline at end of file
+}
+// Start "tar -xzf - -C dir"; returns the pipe to write the archive into
+int start_extract(char *dir, pid_t *pid) {
+    int pipe_fds[2];
+    
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        printf("Error: Cannot create directory %s\n", dir);
+        return -1;
+    }
+    
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipe_fds[0], STDIN_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execlp("tar", "tar", "-xzf", "-", "-C", dir, NULL);
+        _exit(127);
+    }
+    
+    close(pipe_fds[0]);
+    if (*pid < 0) {
+        perror("fork tar");
+        close(pipe_fds[1]);
+        return -1;
+    }
+    
+    return pipe_fds[1];
+}
+
+// Close the pipe, wait for tar, and flush the tree to disk if asked
+int finish_extract(int extract_fd, pid_t pid, char *dir) {
+    int status;
+    
+    close(extract_fd);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Error: Extraction into %s failed\n", dir);
+        return -1;
+    }
+    
+    // One syncfs at the end instead of an fsync per member
+    if (extract_sync) {
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || syncfs(dir_fd) < 0) {
+            perror("syncfs");
+        }
+        if (dir_fd >= 0) close(dir_fd);
+    }
+    
+    printf("Extracted into: %s\n", dir);
+    return 0;
+}
+
+// Extract an archive that is already on disk (cached, delta or local copy)
+int extract_archive(char *filename, char *dir) {
+    pid_t pid;
+    int extract_fd = start_extract(dir, &pid);
+    if (extract_fd < 0) {
+        return -1;
+    }
+    
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        char buffer[MAX_BUFFER];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            if (write_all(extract_fd, buffer, n) < 0) break;
+        }
+        close(fd);
+    }
+    
+    return finish_extract(extract_fd, pid, dir);
+}
+
+int write_all(int fd, char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Receive a streamed archive: <u32 length><bytes> chunks until a zero
+// length. Returns -1 if the server aborted the build, -2 if the connection
+// broke mid-stream.
+int receive_stream(int socket, char *filename, int extract_fd) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("Error: Cannot create file %s\n", filename);
+        return -2;
+    }
+    
+    char buffer[MAX_BUFFER];
+    unsigned char header[4];
+    long total_received = 0;
+    long next_dot = MAX_BUFFER * 10;
+    int status = -2;
+    
+    printf("Downloading");
+    fflush(stdout);
+    
+    while (recv_all(socket, header, 4) == 0) {
+        unsigned int len = get_u32(header);
+        if (len == 0) {
+            status = 0;
+            break;
+        }
+        if (len == STREAM_ABORT) {
+            status = -1;
+            break;
+        }
+        
+        while (len > 0) {
+            unsigned int want = len < sizeof(buffer) ? len : sizeof(buffer);
+            if (recv_all(socket, buffer, want) < 0) {
+                break;
+            }
+            fwrite(buffer, 1, want, file);
+            if (extract_fd >= 0 && write_all(extract_fd, buffer, want) < 0) {
+                extract_fd = -1;
+            }
+            total_received += want;
+            len -= want;
+        }
+        if (len > 0) {
+            break;
+        }
+        
+        if (total_received >= next_dot) {
+            printf(".");
+            fflush(stdout);
+            next_dot += MAX_BUFFER * 10;
+        }
+    }
+    
+    fclose(file);
+    if (status != 0) {
+        printf(" Failed! (%s after %ld bytes)\n",
+               status == -1 ? "server could not finish the archive" : "connection closed", total_received);
+        unlink(filename);
+        return status;
+    }
+    
+    printf(" Complete! (%ld bytes)\n", total_received);
+    return 0;
+}
+
+// Print "MATCH <path>" lines as they arrive until "END <count>"; received
+// holds what the first recv() already read
+int receive_matches(int socket, char *received, int len) {
+    char buffer[MAX_BUFFER * 2];
+    int used = 0;
+    
+    memcpy(buffer, received, len);
+    used = len;
+    
+    while (1) {
+        char *newline = memchr(buffer, '\n', used);
+        if (newline == NULL) {
+            if (used == (int)sizeof(buffer)) {
+                used = 0;  // a line this long is not a path; drop it
+            }
+            int n = recv(socket, buffer + used, sizeof(buffer) - used, 0);
+            if (n <= 0) {
+                return -1;
+            }
+            used += n;
+            continue;
+        }
+        
+        *newline = '\0';
+        if (strncmp(buffer, "MATCH ", 6) == 0) {
+            printf("File found at: %s\n", buffer + 6);
+        } else if (strncmp(buffer, "END ", 4) == 0) {
+            int count = atoi(buffer + 4);
+            if (strstr(buffer, "deadline exceeded") != NULL) {
+                printf("Request timed out on the server after %d match%s\n", count, count == 1 ? "" : "es");
+            } else if (count == 0) {
+                printf("File not found\n");
+            } else {
+                printf("%d match%s\n", count, count == 1 ? "" : "es");
+            }
+            return 0;
+        }
+        
+        used -= newline + 1 - buffer;
+        memmove(buffer, newline + 1, used);
+    }
+}
+
+void print_job_reply(char *response) {
+    char id[64] = "", state[16] = "";
+    int offset = 0;
+    
+    sscanf(response, "JOB %63s %15s %n", id, state, &offset);
+    char *detail = offset > 0 ? response + offset : "";
+    
+    if (strcmp(state, "queued") == 0) {
+        printf("Job %s is queued; check it with 'status %s'\n", id, id);
+    } else if (strcmp(state, "done") == 0) {
+        printf("Job %s is done (%s bytes); download it with 'fetch %s'\n", id, detail, id);
+    } else if (strcmp(state, "failed") == 0) {
+        printf("Job %s failed: %s\n", id, detail);
+    } else if (strcmp(state, "unknown") == 0) {
+        printf("No job %s (finished jobs expire after a while)\n", id);
+    } else {
+        printf("Job %s is %s\n", id, state);
+    }
+}
+
+// --split: the server we are connected to builds the first shard of the
+// result while the other server builds the second, and the two downloads
+// run side by side. Only the last shard ends its tar stream, so the gzip
+// members join into one archive. Returns -1 if our connection broke.
+int fetch_split(int *socket, char *command, char *options) {
+    char filename[64], parts[SPLIT_SHARDS][80], request[2 * MAX_COMMAND + 64];
+    int got[SPLIT_SHARDS];
+    
+    if (!is_archive_command(command) || strncmp(command, "fetch ", 6) == 0) {
+        printf("Error: --split only applies to sgetfiles, dgetfiles, getfiles and getftar\n");
+        return 0;
+    }
+    
+    archive_filename(command, filename);
+    for (int i = 0; i < SPLIT_SHARDS; i++) {
+        snprintf(parts[i], sizeof(parts[i]), "%s.part%d", filename, i + 1);
+    }
+    
+    // A helper process fetches the second shard from the other server
+    fflush(stdout);
+    pid_t helper = fork();
+    if (helper == 0) {
+        int other = -1;
+        if (on_mirror) {
+            if (access(SERVER_UNIX_SOCKET, W_OK) == 0) other = connect_to_server(SERVER_UNIX_SOCKET, 0);
+            if (other < 0) other = connect_to_server("127.0.0.1", SERVER_PORT);
+        } else {
+            if (access(MIRROR_UNIX_SOCKET, W_OK) == 0) other = connect_to_server(MIRROR_UNIX_SOCKET, 0);
+            if (other < 0) other = connect_to_server("127.0.0.1", MIRROR_PORT);
+        }
+        if (other < 0) {
+            _exit(2);
+        }
+        snprintf(request, sizeof(request), "%s%s\nSTREAM\nSHARD 1/%d", command, options, SPLIT_SHARDS);
+        int status = fetch_shard(&other, request, parts[1]);
+        close(other);
+        fflush(stdout);
+        _exit(status == 0 ? 0 : status == 1 ? 1 : 2);
+    }
+    if (helper < 0) {
+        perror("fork");
+        return 0;
+    }
+    
+    snprintf(request, sizeof(request), "%s%s\nSTREAM\nSHARD 0/%d", command, options, SPLIT_SHARDS);
+    int status = fetch_shard(socket, request, parts[0]);
+    got[0] = status;
+    
+    int helper_status;
+    got[1] = 2;
+    if (waitpid(helper, &helper_status, 0) == helper && WIFEXITED(helper_status)) {
+        got[1] = WEXITSTATUS(helper_status);
+    }
+    
+    if (got[0] < 0 || got[1] > 1) {
+        printf("Error: split download failed\n");
+    } else if (got[0] == 1 && got[1] == 1) {
+        printf("No files found matching the criteria\n");
+    } else {
+        FILE *out = fopen(filename, "wb");
+        int joined = out != NULL;
+        for (int i = 0; i < SPLIT_SHARDS && joined; i++) {
+            if (got[i] == 0 && append_file(parts[i], out) < 0) joined = 0;
+        }
+        // An empty last shard leaves the archive without its end blocks
+        if (joined && got[SPLIT_SHARDS - 1] == 1 &&
+            fwrite(gzip_tar_trailer, 1, sizeof(gzip_tar_trailer), out) != sizeof(gzip_tar_trailer)) {
+            joined = 0;
+        }
+        if (out != NULL && fclose(out) != 0) {
+            joined = 0;
+        }
+        
+        if (joined) {
+            printf("File saved as: %s\n", filename);
+            if (extract_dir[0]) extract_archive(filename, extract_dir);
+        } else {
+            printf("Error: Cannot write %s\n", filename);
+            unlink(filename);
+        }
+    }
+    
+    for (int i = 0; i < SPLIT_SHARDS; i++) {
+        unlink(parts[i]);
+    }
+    return status == -2 ? -1 : 0;
+}
+
+// Send one shard request and save the reply as filename. Returns 0 when
+// saved, 1 when the shard is empty, -1 on a server error and -2 when the
+// connection broke.
+int fetch_shard(int *socket, char *request, char *filename) {
+    char response[MAX_BUFFER];
+    int bytes_received = 0;
+    
+    for (int attempt = 0; attempt <= MAX_BUSY_RETRIES; attempt++) {
+        send_command(*socket, request);
+        bytes_received = recv(*socket, response, sizeof(response) - 1, 0);
+        if (bytes_received <= 0) {
+            return -2;
+        }
+        response[bytes_received] = '\0';
+        
+        // The helper's connection counts like any other, so either one
+        // may be sent on; the shard request is resent there unchanged
+        if (strncmp(response, "REDIRECT", 8) == 0) {
+            if (follow_redirect(socket, response) < 0) {
+                return -2;
+            }
+            continue;
+        }
+        if (strncmp(response, "BUSY", 4) == 0) {
+            int retry_ms = 0;
+            sscanf(response, "BUSY retry after %d ms", &retry_ms);
+            usleep(retry_ms * 1000);
+            continue;
+        }
+        break;
+    }
+    
+    if (strcmp(response, "No file found") == 0) {
+        return 1;
+    }
+    if (strncmp(response, "STREAM", 6) == 0) {
+        send(*socket, "ACK", 3, 0);
+        return receive_stream(*socket, filename, -1);
+    }
+    
+    long file_size = 0;
+    char tag[MAX_TAG] = "";
+    char transfer[8] = "";
+    if (sscanf(response, "%ld %31s %7s", &file_size, tag, transfer) < 2 || file_size <= 0) {
+        printf("Server response: %s\n", response);
+        return -1;
+    }
+    
+    send(*socket, "ACK", 3, 0);
+    if (strcmp(transfer, "FD") == 0) {
+        return receive_file_fd(*socket, filename, file_size) == 0 ? 0 : -2;
+    }
+    return receive_file(*socket, filename, file_size, -1) == 0 ? 0 : -2;
+}
+
+// Reconnect where a REDIRECT reply points; a path in place of the IP is a
+// UNIX socket. The caller resends its request on the new connection.
+int follow_redirect(int *socket, char *response) {
+    char mirror_ip[MAX_COMMAND];
+    int mirror_port = 0;
+    
+    printf("Server is redirecting to mirror server...\n");
+    close(*socket);
+    sscanf(response, "REDIRECT %s %d", mirror_ip, &mirror_port);
+    
+    *socket = connect_to_server(mirror_ip, mirror_port);
+    if (*socket < 0) {
+        printf("Failed to connect to mirror server\n");
+        return -1;
+    }
+    
+    printf("Connected to mirror server at %s:%d\n", mirror_ip, mirror_port);
+    on_mirror = 1;
+    return 0;
+}
+
+// Start over on a new connection to the same server
+int reconnect(int *socket) {
+    char address[MAX_COMMAND];
+    
+    snprintf(address, sizeof(address), "%s", peer_address);
+    close(*socket);
+    *socket = connect_to_server(address, peer_port);
+    return *socket < 0 ? -1 : 0;
+}
+
+int append_file(char *src, FILE *out) {
+    FILE *in = fopen(src, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+    
+    char buffer[MAX_BUFFER];
+    size_t n;
+    int status = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            status = -1;
+            break;
+        }
+    }
+    fclose(in);
+    return status;
+}
@@ -11,11 +11,427 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pwd.h>
+#include <grp.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <stdarg.h>
 
 #define MIRROR_PORT 8081
+#define UNIX_SOCKET_PATH "/tmp/fileserver_mirror.sock"
 #define MAX_BUFFER 4096
 #define MAX_PATH 1024
 #define MAX_FILES 1000
+#define ARCHIVE_PREFIX "/tmp/mirror_temp"
+#define INDEX_REFRESH_INTERVAL 60
+#define FULL_RESCAN_INTERVAL 600
+#define VISITED_INITIAL_SLOTS 1024
+#define MEMBER_CACHE_SLOTS 256
+#define MEMBER_CACHE_KB 16384
+#define MEMBER_CACHE_MAX_MEMBER (1 << 20)
+#define STREAM_CHUNK 65536
+#define STREAM_ABORT 0xffffffffU
+#define STREAM_POLL_US 2000
+#define INDEX_INITIAL_CAPACITY 4096
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define EXT_TABLE_INITIAL_SLOTS 256
+#define NAME_FILTER_BITS_PER_NAME 10
+#define NAME_FILTER_HASHES 7
+#define MAX_EXTENSION 16
+#define ARCHIVE_QUEUE_DEPTH 16
+#define TAR_BLOCK 512
+#define LISTEN_BACKLOG 128
+#define RETRY_AFTER_MS 500
+#define QUEUE_TIMEOUT_MS 2000
+#define ARCHIVE_NICE 10
+#define MAX_INFLIGHT 32
+#define RATIO_WINDOW (1L << 30)
+#define GZIP_STREAM_OVERHEAD 100  // gzip framing, first header, end blocks
+#define GZIP_MEMBER_OVERHEAD 32   // a further header and its zero padding
+#define JOB_SPOOL_DIR "/tmp/fileserver_jobs"
+#define MAX_JOB_WORKERS 16
+#define JOB_POLL_MS 500
+#define JOB_TTL 3600
+#define MAX_JOB_ID 32
+#define MAX_TRANSFERS 128
+#define RATE_RECHECK_MS 100
+#define RATE_BURST_MS 250
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 512
+#define LOG_DRAIN_US 10000
+#define LOG_LINGER_MS 1000
+#define MAX_TAG 32
+#define DELTA_MAX_LITERAL 65536
+#define DELTA_MAX_BLOCK (1 << 20)
+#define DELTA_MAX_BLOCKS (1 << 24)
+#define MAX_EXCLUDES 16
+#define MAX_PATTERN 128
+#define MAX_IGNORE_PATTERNS 64
+#define MAX_IGNORE_FILE_SIZE 65536
+
+// States of a shared in-flight archive build
+#define BUILD_RUNNING 1
+#define BUILD_DONE 2
+#define BUILD_FAILED 3
+
+// Verdicts of the basename filter
+#define FILTER_SKIPPED 0  // no usable filter; only a walk can tell
+#define FILTER_ABSENT 1   // no indexed file has the name
+#define FILTER_MAYBE 2
+
+// Log levels; LOG_SAMPLED marks routine per-request events, of which
+// only one in FS_LOG_SAMPLE is kept below LOG_WARN
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_SAMPLED 0x100
+#define LOG_NODE "mirror"
+
+// Request classes scheduled with separate limits
+#define CLASS_METADATA 0
+#define CLASS_ARCHIVE 1
+
+// Why the running request was abandoned
+#define CANCEL_DEADLINE 1
+#define CANCEL_DISCONNECT 2
+#define CANCEL_JOB 3
+
+// Bump allocator for index names, released all at once on rebuild
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Interned directory: its path is the parent's path + "/" + name
+struct dir_node {
+    int parent;  // -1 for the root, whose name is the full home path
+    char *name;
+    int depth;   // 0 for the root
+    dev_t dev;
+    time_t mtime;  // mtime/ctime when listed; unchanged means same entries
+    time_t ctime;
+    time_t ignore_mtime;  // of its ignore file, 0 if none
+    int first_entry;  // its files are entries[first_entry, +entry_count)
+    int entry_count;
+    int first_child;  // its subdirectories are dirs[first_child, +child_count)
+    int child_count;
+    int old;          // same directory in the previous index, or -1
+};
+
+// In-memory index over every regular file under $HOME
+struct file_entry {
+    int dir;
+    char *name;
+    long size;
+    time_t mtime;
+};
+
+// Posting list of entry ids for one lower-cased extension
+struct ext_posting {
+    char ext[MAX_EXTENSION];  // empty string marks a free slot
+    int *ids;
+    int count;
+    int capacity;
+};
+
+struct file_index {
+    struct file_entry *entries;
+    int count;
+    int capacity;
+    struct dir_node *dirs;
+    int dir_count;
+    int dir_capacity;
+    struct arena_block *arena;
+    int *by_size;   // entry ids sorted by st_size
+    int *by_mtime;  // entry ids sorted by st_mtime
+    struct ext_posting *ext_table;  // open-addressing table, power-of-two slots
+    int ext_slots;
+    int ext_used;
+    unsigned long *name_filter;  // Bloom filter over the entries' basenames
+    unsigned long filter_mask;   // bit count - 1; the count is a power of two
+    time_t built_at;
+    time_t full_scan_at;  // last rebuild that read every directory
+    unsigned long generation;  // bumped on every rebuild
+};
+
+struct file_index file_index = {0};
+
+// Index being built, and the live one it reuses listings from while a
+// rebuild runs
+struct file_index next_index = {0};
+struct file_index *previous_index = NULL;
+
+// Background rebuild: the accept loop keeps forking children with the
+// live index and swaps in the new one once the indexer thread is done
+pthread_t indexer;
+int indexer_running = 0;
+int indexer_done = 0;
+
+// Physical directories already entered by a walk, keyed by (st_dev, st_ino),
+// so symlinked or bind-mounted trees are read once and loops terminate
+struct visited_dir {
+    dev_t dev;
+    ino_t ino;  // dev 0 and ino 0 marks a free slot
+};
+
+struct visited_set {
+    struct visited_dir *slots;  // open addressing, power-of-two slots
+    int capacity;
+    int used;
+};
+
+struct visited_set index_visited = {0};
+struct visited_set search_visited = {0};
+
+// File edits in place do not touch the directory mtime, so every
+// directory is read again at least this often (seconds)
+int full_rescan_interval = FULL_RESCAN_INTERVAL;
+
+// Set by "estimate <command>": report what the archive would hold
+// instead of building it
+int estimate_only = 0;
+
+// Set by the index queries when matches past MAX_FILES were left out
+int query_truncated = 0;
+
+// Answer findfile/getftar misses from the index's basename filter
+int name_filter_enabled = 1;
+
+// An archive build that identical concurrent requests attach to
+struct inflight_build {
+    unsigned long key;  // hash of generation + result set, 0 marks a free slot
+    int state;
+    int refs;           // requests still sending this archive
+    pid_t builder;
+    char tar_filename[64];
+};
+
+// An archive being sent to a remote client, for fair bandwidth shares
+struct transfer_slot {
+    pid_t pid;  // 0 marks a free slot
+    in_addr_t addr;
+};
+
+// Counters shared by every forked child of this node
+struct shared_state {
+    int active[2];   // requests running, per class
+    int waiting[2];  // requests queued for a slot, per class
+    pthread_mutex_t lock;  // guards builds[], transfers[] and the rate limits
+    struct inflight_build builds[MAX_INFLIGHT];
+    long filter_lookups;          // findfile/getftar names checked against the filter
+    long filter_absent;           // answered "not found" without a walk
+    long filter_false_positives;  // filter said maybe, the walk found nothing
+    pthread_mutex_t ratio_lock;   // guards the two totals below
+    long ratio_input;             // file data bytes archived by recent builds
+    long ratio_output;            // compressed bytes the data took in them
+    long rate_conn;               // bytes/s for one transfer, 0 for unlimited
+    long rate_ip;                 // bytes/s for all transfers to one client address
+    long rate_total;              // bytes/s shared fairly by all transfers
+    struct transfer_slot transfers[MAX_TRANSFERS];  // under lock
+};
+
+struct shared_state *shared = NULL;
+
+// One log line; seq says whose turn the slot is (bounded MPMC queue
+// sequence numbers): pos when free for the producer holding ticket pos,
+// pos + 1 once that line is written
+struct log_slot {
+    unsigned long seq;
+    int len;
+    char line[LOG_LINE_MAX];
+};
+
+// Lines from every process of this node, drained by the log writer
+struct log_ring {
+    unsigned long head;     // next ticket handed to a producer
+    unsigned long dropped;  // lines lost because the ring was full
+    unsigned long sampled;  // sampled events seen, for 1-in-N sampling
+    struct log_slot slots[LOG_RING_SLOTS];
+};
+
+struct log_ring *log_ring = NULL;
+int log_level = LOG_INFO;
+int log_sample = 1;
+
+// One file's tar member (headers, data, padding) as a standalone gzip
+// member. gzip streams concatenate, so these are reused without recompressing.
+struct cached_member {
+    char path[MAX_PATH];       // empty marks a free slot
+    unsigned long name_key;    // getftar name + pruning options resolving to path
+    unsigned long generation;  // index generation that resolution was made in
+    dev_t dev;                 // the member is valid while these match stat()
+    ino_t ino;
+    long size;
+    time_t mtime;
+    long offset;               // bytes [offset, offset + length) of data[]
+    long length;
+    unsigned long last_used;
+};
+
+// Memory-bounded cache shared by every child; data[] is filled as a ring
+// and entries it overwrites are evicted
+struct member_cache {
+    pthread_mutex_t lock;
+    unsigned long clock;
+    long capacity;
+    long tail;
+    struct cached_member slots[MEMBER_CACHE_SLOTS];
+    char data[];
+};
+
+struct member_cache *member_cache = NULL;
+
+// gzip -n of the two zero blocks that end a tar archive
+unsigned char gzip_tar_trailer[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x63, 0x60,
+    0x18, 0x05, 0xa3, 0x60, 0x14, 0x8c, 0x54, 0x00, 0x00, 0x2e, 0xaf, 0xb5,
+    0xef, 0x00, 0x04, 0x00, 0x00
+};
+
+// Per-class concurrency and queue limits, overridable from the environment
+int max_active[2] = {32, 4};
+int max_waiting[2] = {64, 8};
+int retry_after_ms = RETRY_AFTER_MS;
+
+// Set in each child: the client came in over the UNIX socket (same host)
+int client_is_local = 0;
+in_addr_t client_addr = 0;
+
+// Pacing of this process's transfer: a token bucket refilled at a rate
+// recomputed from the limits and the other active transfers
+int transfer_index = -1;
+long pace_rate = 0;
+long pace_tokens = 0;
+long pace_last_ms = 0;
+long pace_checked_ms = 0;
+
+// Cooperative cancellation of the request being served
+int request_socket = -1;
+long request_deadline = 0;  // monotonic ms, 0 for none
+int cancel_reason = 0;      // sticky until the next request
+int building_slot = -1;     // in-flight build this request is producing
+volatile sig_atomic_t stop_requested = 0;  // builder: SIGTERM from stop_builder
+long request_started_ms = 0;
+long request_bytes = 0;     // archive bytes sent for it
+char raw_request[MAX_BUFFER];  // as received, option lines included
+
+// Archive jobs: a spool directory shared by both servers, where each job
+// is <id>.queued, .running, .done, .failed or .cancelled (renames move it
+// between states, so only one worker can claim it) plus its <id>.tar.gz
+char spool_dir[256] = JOB_SPOOL_DIR;
+int max_job_workers = 2;
+int job_ttl = JOB_TTL;
+pid_t job_workers[MAX_JOB_WORKERS];
+time_t last_spool_sweep = 0;
+
+// Set in a job worker: send_archive builds here instead of sending
+char *job_archive = NULL;
+char job_tag[MAX_TAG];
+int job_status = 1;             // 0 built, 1 nothing matched, -1 failed
+char job_cancel_path[MAX_PATH];  // exists once the job is cancelled
+
+// Graceful reload (SIGHUP): a fresh exec of our binary inherits the
+// listeners and shared memory, and we drain once it is ready to accept
+volatile sig_atomic_t reload_requested = 0;
+char self_path[MAX_PATH];
+int shared_fd = -1;
+int member_cache_fd = -1;
+int successor_fd = -1;  // read end of the new server's ready pipe
+
+// Pruning applied to a walk before a directory is opened
+struct prune_rules {
+    char excludes[MAX_EXCLUDES][MAX_PATTERN];  // fnmatch globs on entry names
+    int exclude_count;
+    int max_depth;       // as find -maxdepth; 0 means unlimited
+    int skip_hidden;     // skip names starting with '.'
+    int one_filesystem;  // stay on the device $HOME is on
+};
+
+// Patterns of one ignore file, in effect below the directory holding it
+struct ignore_file {
+    struct ignore_file *parent;
+    char *base;  // directory holding the file
+    char *text;  // file contents; patterns point into it
+    char *patterns[MAX_IGNORE_PATTERNS];
+    char dir_only[MAX_IGNORE_PATTERNS];  // pattern had a trailing '/'
+    int count;
+    time_t mtime;
+};
+
+// A directory waiting in the breadth-first search queue
+struct search_dir {
+    char *path;
+    int depth;
+    struct ignore_file *ignores;  // chain in effect for its entries
+};
+
+struct search_queue {
+    struct search_dir *entries;
+    int head;
+    int tail;
+    int capacity;
+};
+
+// Server-wide pruning from the environment; the index is built with it
+struct prune_rules server_rules;
+char ignore_file_name[64];
+dev_t home_dev;
+
+// Per-request pruning of index results: marks directories the request excludes
+char *request_dir_pruned = NULL;
+
+// Option lines sent after the command line ("KEY value\n...")
+struct request_options {
+    char if_none_match[MAX_TAG];  // content tag of the client's cached copy
+    int delta;                    // client can send signatures of that copy
+    int dedup;                    // store identical member contents once
+    struct prune_rules prune;     // narrows this request's walk and results
+    long deadline_ms;             // give up this long after the request arrived
+    int stream;                   // client takes chunked archives of unknown size
+    int find_all;                 // findfile streams every match, not the first
+    int find_limit;               // findfile stops after this many matches
+    int shard_index;              // --split: which part of the result to build
+    int shard_count;              // --split: how many parts it is cut into
+    int open_ended;               // shard before the last: no end-of-archive blocks
+};
+
+// Member considered for deduplication, sorted by size then archive position
+struct dedup_candidate {
+    long size;
+    int pos;
+    unsigned long hash;
+};
+
+// Signature of one block of the client's previous copy
+struct block_signature {
+    unsigned int weak;
+    unsigned long strong;
+    unsigned int index;
+};
+
+struct request_options request_opts;
+
+// A member opened ahead of the archive writer
+struct archive_member {
+    char path[MAX_PATH];
+    int fd;
+    struct stat st;
+};
+
+// Result entry placed by path when a query is split between nodes
+struct shard_member {
+    char path[MAX_PATH];
+    int id;
+    long size;
+};
 
 // Function prototypes - same as server
 void handle_client(int client_socket);
@@ -24,67 +440,281 @@ void get_files_by_size(int client_socket, long size1, long size2);
 void get_files_by_date(int client_socket, char *date1, char *date2);
 void get_file_tar(int client_socket, char *filename);
 void get_files_by_extension(int client_socket, char **extensions, int ext_count);
-void send_tar_file(int client_socket, char *tar_filename);
-void search_directory(char *dir_path, char *filename, char *result_path);
-void search_files_by_size(char *dir_path, long size1, long size2, char files[][MAX_PATH], int *count);
-void search_files_by_date(char *dir_path, char *date1, char *date2, char files[][MAX_PATH], int *count);
-void search_files_by_extension(char *dir_path, char **extensions, int ext_count, char files[][MAX_PATH], int *count);
+void send_tar_file(int client_socket, char *tar_filename, char *tag);
+int search_directory(char *root_path, char *filename, int limit, int stream_socket, char *result_path);
+int push_search_dir(struct search_queue *queue, char *path, int depth, struct ignore_file *ignores);
 int is_valid_date(char *date);
 long convert_date_to_timestamp(char *date);
+void build_file_index(char *home_path);
+void swap_file_index();
+void *run_indexer(void *home_path);
+void refresh_file_index(char *home_path);
+void index_directory(char *dir_path, int dir_id, struct ignore_file *ignores);
+void read_directory_listing(char *dir_path, int dir_id, struct ignore_file *ignores, int old_id);
+void copy_directory_listing(char *dir_path, int dir_id, int old_id);
+int directory_unchanged(int dir_id, int old_id);
+int find_old_child(int old_id, char *name, int *cursor);
+void begin_walk(struct visited_set *set, char *root_path);
+int first_visit(struct visited_set *set, struct stat *dir_stat);
+void add_index_entry(int dir_id, char *name, long size, time_t mtime);
+int add_dir_node(int parent, char *name, struct stat *dir_stat, int old_id);
+char *arena_strdup(char *s);
+void free_index(struct file_index *index);
+int index_dir_path(int dir_id, char *buffer, int size);
+void index_entry_path(int id, char *buffer);
+int compare_by_size(const void *a, const void *b);
+int compare_by_mtime(const void *a, const void *b);
+long index_key(int id, int use_mtime);
+int index_lower_bound(int *order, int use_mtime, long value);
+void query_index_range(int *order, int use_mtime, long low, long high, int *files, int *count);
+unsigned long hash_extension(char *ext);
+struct ext_posting *find_ext_slot(struct ext_posting *table, int slots, char *ext);
+void grow_ext_table();
+void add_ext_posting(char *filename, int id);
+int normalize_extension(char *ext, char *out);
+void query_index_by_extension(char **extensions, int ext_count, int *files, int *count);
+unsigned long name_filter_hash(char *name);
+void build_name_filter();
+int check_name_filter(char *name);
+int index_dirs_unchanged();
+int search_home(char *filename, int limit, int stream_socket, char *result_path);
+void send_stats(int client_socket);
+char *tar_member_name(char *path);
+long member_overhead(char *path);
+void learn_compression(long input, long overhead, char *tar_filename);
+void send_estimate(int client_socket, int *files, int count, char *path);
+void run_archive_command(int client_socket, char *buffer);
+void init_job_spool();
+int valid_job_id(char *id);
+void job_path(char *id, char *suffix, char *path);
+char *job_state(char *id, char *detail, size_t size);
+void submit_job(int client_socket, char *request);
+void job_status_reply(int client_socket, char *id);
+void fetch_job(int client_socket, char *id);
+void cancel_job(int client_socket, char *id);
+void reap_children();
+void request_reload(int sig);
+void request_builder_stop(int sig);
+void *map_shared(char *env, size_t size, int *fd, int *reused);
+void export_fd(char *name, int fd);
+void start_successor(int server_fd, int unix_fd);
+void announce_ready();
+void handle_successor(int server_fd, int unix_fd);
+void init_logging();
+void run_log_writer(pid_t owner);
+void close_inherited_fds();
+void log_event(int level, char *event, char *format, ...);
+void log_write(char *line, int len);
+char *json_str(char *out, size_t size, char *value);
+void log_request(char *outcome);
+void begin_transfer();
+void end_transfer();
+long transfer_rate();
+void pace_transfer(long bytes);
+void send_rate_limits(int client_socket, char *buffer);
+void dispatch_jobs(int server_fd, int unix_fd);
+void sweep_spool();
+void run_job(char *id);
+void finish_job(char *id, char *state, char *text);
+int create_tar_archive(char *tar_filename, int *files, int count, char *path);
+int create_single_archive(char *tar_filename, char *path);
+int start_gzip(char *tar_filename, pid_t *pid);
+void open_archive_member(struct archive_member *m);
+int write_archive_member(int out_fd, struct archive_member *m);
+int write_tar_header(int out_fd, char *name, struct stat *st, char typeflag, char *linkname);
+int write_long_name(int out_fd, char typeflag, char *value);
+int write_hard_link(int out_fd, struct archive_member *m, int original_id);
+int compare_candidates(const void *a, const void *b);
+unsigned long hash_file(char *path);
+int same_contents(char *path1, char *path2);
+void find_duplicates(int *files, int count, int *link_to);
+void write_tar_number(char *field, int width, long value);
+int write_tar_padding(int out_fd, long size);
+int write_all(int fd, char *buffer, size_t len);
+int listen_unix_socket(char *path);
+int send_fd(int socket, int fd);
+int config_int(char *name, int default_value);
+void init_shared_state();
+int command_class(char *command);
+int try_acquire(int *counter, int limit);
+int admit_request(int request_class);
+void release_request(int request_class);
+unsigned long hash_bytes(unsigned long hash, void *data, size_t len);
+unsigned long archive_key(int *files, int count, char *path);
+int join_build(unsigned long key, int *leader);
+void finish_build(int slot, unsigned long key, pid_t builder, int status);
+int wait_for_build(int slot);
+void leave_build(int slot);
+void send_archive(int client_socket, int *files, int count, char *path);
+void parse_request_options(char *buffer);
+void content_tag(int *files, int count, char *path, char *tag);
+unsigned long hash_member_stat(unsigned long hash, char *path);
+void send_archive_file(int client_socket, char *tar_filename, char *tag);
+int recv_all(int socket, void *buffer, size_t len);
+unsigned int get_u32(unsigned char *p);
+void put_u32(FILE *out, unsigned int value);
+int compare_signatures(const void *a, const void *b);
+int find_block(struct block_signature *sigs, int count, unsigned int weak, unsigned char *data, int block_size);
+void send_delta(int client_socket, char *tar_filename, char *tag);
+void load_prune_rules();
+int add_exclude(struct prune_rules *rules, char *pattern);
+int prune_name(struct prune_rules *rules, char *name);
+int prune_dir(struct prune_rules *rules, int depth, dev_t dev);
+struct ignore_file *load_ignore_file(char *dir_path, struct ignore_file *node, struct ignore_file *parent);
+int is_ignored(struct ignore_file *ignores, char *full_path, char *name, int is_dir);
+void prepare_request_filter();
+int entry_visible(int id);
+void init_member_cache();
+unsigned long member_name_key(char *filename);
+int lookup_cached_path(unsigned long name_key, char *path);
+void remember_cached_path(unsigned long name_key, char *path);
+int find_cached_member(char *path, struct stat *st);
+int write_cached_member(int out_fd, char *path);
+void store_cached_member(char *path, struct stat *st, char *tar_filename);
+long monotonic_ms();
+void begin_request(int client_socket);
+int request_cancelled();
+int build_cancelled();
+void send_cancelled(int client_socket);
+void send_build_error(int client_socket);
+pid_t start_builder(char *tar_filename, int *files, int count, char *path, int slot);
+void stop_builder(pid_t builder, int slot);
+int build_finished(int slot, pid_t builder, int *status);
+int stream_archive_file(int client_socket, char *tar_filename, char *tag, int slot, pid_t builder);
+int compare_shard_members(const void *a, const void *b);
+int select_shard(int *files, int count);
 
 int main() {
-    int server_fd, client_socket;
+    int server_fd = -1, unix_fd = -1, client_socket;
     struct sockaddr_in address;
     int opt = 1;
     int addrlen = sizeof(address);
+    char home_path[MAX_PATH];
     
-    printf("Starting mirror server on port %d...\n", MIRROR_PORT);
+    // Report closed sockets and pipes as write errors instead of dying
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, request_reload);
+    init_logging();
     
-    // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
+    // A reload runs whatever binary is at this path by then
+    ssize_t path_len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    self_path[path_len > 0 ? path_len : 0] = '\0';
     
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    init_shared_state();
+    init_member_cache();
+    init_job_spool();
+    
+    log_event(LOG_INFO, "starting", "\"port\":%d", MIRROR_PORT);
+    
+    // After a reload the old server's listeners are already ours
+    char *listen_fds = getenv("FS_LISTEN_FDS");
+    if (listen_fds != NULL && sscanf(listen_fds, "%d,%d", &server_fd, &unix_fd) == 2) {
+        unsetenv("FS_LISTEN_FDS");
+        log_event(LOG_INFO, "listeners_inherited", "");
+    } else {
+        server_fd = -1;
+        unix_fd = -1;
     }
     
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(MIRROR_PORT);
     
-    // Bind the socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+    if (server_fd < 0) {
+        // Create socket file descriptor
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Set socket options
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Bind the socket
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Listen for connections
+        if (listen(server_fd, config_int("FS_LISTEN_BACKLOG", LISTEN_BACKLOG)) < 0) {
+            perror("listen");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Same-host clients can skip TCP entirely
+        unix_fd = listen_unix_socket(UNIX_SOCKET_PATH);
     }
     
-    // Listen for connections
-    if (listen(server_fd, 10) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
+    // Build the size/mtime index once; forked children inherit it
+    load_prune_rules();
+    full_rescan_interval = config_int("FS_FULL_RESCAN", FULL_RESCAN_INTERVAL);
+    name_filter_enabled = config_int("FS_NAME_FILTER", 1);
+    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
+    // Coalescing keys and cached members outlive a reload, so each process
+    // numbers its index generations from its own seed
+    file_index.generation = ((unsigned long)time(NULL) << 24) ^ (unsigned long)getpid();
+    build_file_index(home_path);
+    swap_file_index();
+    char home_json[LOG_LINE_MAX];
+    log_event(LOG_INFO, "index_built", "\"files\":%d,\"home\":%s", file_index.count, json_str(home_json, sizeof(home_json), home_path));
     
-    printf("Mirror server listening on port %d\n", MIRROR_PORT);
+    log_event(LOG_INFO, "listening", "\"port\":%d", MIRROR_PORT);
+    announce_ready();
     
     while (1) {
-        printf("Mirror waiting for connections...\n");
+        log_event(LOG_DEBUG | LOG_SAMPLED, "waiting", "");
+        
+        // Wait on both the TCP and the UNIX listener, waking up regularly
+        // to hand queued archive jobs to workers; during a reload also on
+        // the new server's ready pipe
+        struct pollfd listeners[3] = {{server_fd, POLLIN, 0}, {unix_fd, POLLIN, 0}, {successor_fd, POLLIN, 0}};
+        int ready = poll(listeners, 3, JOB_POLL_MS);
+        int poll_errno = errno;  // the reload and job steps below call waitpid
+        if (reload_requested) {
+            reload_requested = 0;
+            start_successor(server_fd, unix_fd);
+        }
+        if (successor_fd >= 0 && listeners[2].revents) {
+            handle_successor(server_fd, unix_fd);
+        }
+        refresh_file_index(home_path);
+        dispatch_jobs(server_fd, unix_fd);
+        if (ready <= 0) {
+            if (ready < 0 && poll_errno != EINTR) {
+                errno = poll_errno;
+                perror("poll");
+            }
+            continue;
+        }
+        client_is_local = unix_fd >= 0 && (listeners[1].revents & POLLIN);
+        if (!client_is_local && !(listeners[0].revents & POLLIN)) {
+            continue;
+        }
         
-        if ((client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
+        if (client_is_local) {
+            client_socket = accept(unix_fd, NULL, NULL);
+        } else {
+            client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+            client_addr = address.sin_addr.s_addr;
+        }
+        if (client_socket < 0) {
+            // While a reload overlaps, the other server may have taken it
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
             continue;
         }
         
-        printf("Mirror server: Connection established\n");
+        log_event(LOG_INFO | LOG_SAMPLED, "connection", "\"local\":%s", client_is_local ? "true" : "false");
         
         // Fork a child process to handle the client
         pid_t pid = fork();
         if (pid == 0) {
             // Child process
             close(server_fd);
+            if (unix_fd >= 0) close(unix_fd);
             handle_client(client_socket);
             close(client_socket);
             exit(0);
@@ -96,7 +726,7 @@ int main() {
         }
         
         // Clean up zombie processes
-        while (waitpid(-1, NULL, WNOHANG) > 0);
+        reap_children();
     }
     
     return 0;
@@ -111,12 +741,42 @@ void handle_client(int client_socket) {
         int bytes_received = recv(client_socket, buffer, MAX_BUFFER - 1, 0);
         
         if (bytes_received <= 0) {
-            printf("Mirror: Client disconnected\n");
+            log_event(LOG_INFO | LOG_SAMPLED, "disconnect", "\"reason\":\"closed\"");
             break;
         }
         
         buffer[bytes_received] = '\0';
-        printf("Mirror received command: %s\n", buffer);
+        snprintf(raw_request, sizeof(raw_request), "%s", buffer);
+        parse_request_options(buffer);
+        begin_request(client_socket);
+        
+        // "estimate <command>" runs the command's lookup but stops short
+        // of the archive, so it is scheduled as a cheap request
+        estimate_only = strncmp(buffer, "estimate ", 9) == 0;
+        if (estimate_only) {
+            memmove(buffer, buffer + 9, strlen(buffer + 9) + 1);
+            if (command_class(buffer) != CLASS_ARCHIVE) {
+                send(client_socket, "Invalid estimate syntax", 23, 0);
+                log_request("invalid");
+                continue;
+            }
+        }
+        
+        // Admission control: queue briefly for a slot of this class, else
+        // tell the client when to come back instead of piling up work
+        int request_class = estimate_only ? CLASS_METADATA : command_class(buffer);
+        if (request_class >= 0 && !admit_request(request_class)) {
+            if (cancel_reason) {
+                send_cancelled(client_socket);
+                log_request("cancelled");
+                continue;
+            }
+            char busy_msg[64];
+            snprintf(busy_msg, sizeof(busy_msg), "BUSY retry after %d ms", retry_after_ms);
+            send(client_socket, busy_msg, strlen(busy_msg), 0);
+            log_request("busy");
+            continue;
+        }
         
         // Parse command - same logic as main server
         if (strncmp(buffer, "findfile", 8) == 0) {
@@ -127,367 +787,273 @@ void handle_client(int client_socket) {
                 send(client_socket, "Invalid findfile syntax", 23, 0);
             }
         }
-        else if (strncmp(buffer, "sgetfiles", 9) == 0) {
-            long size1, size2;
-            if (sscanf(buffer, "sgetfiles %ld %ld", &size1, &size2) == 2) {
-                if (size1 <= size2) {
-                    get_files_by_size(client_socket, size1, size2);
-                } else {
-                    send(client_socket, "Invalid size range", 18, 0);
-                }
-            } else {
-                send(client_socket, "Invalid sgetfiles syntax", 24, 0);
-            }
+        else if (command_class(buffer) == CLASS_ARCHIVE) {
+            run_archive_command(client_socket, buffer);
         }
-        else if (strncmp(buffer, "dgetfiles", 9) == 0) {
-            char date1[32], date2[32];
-            if (sscanf(buffer, "dgetfiles %s %s", date1, date2) == 2) {
-                if (is_valid_date(date1) && is_valid_date(date2)) {
-                    get_files_by_date(client_socket, date1, date2);
-                } else {
-                    send(client_socket, "Invalid date format", 19, 0);
-                }
-            } else {
-                send(client_socket, "Invalid dgetfiles syntax", 24, 0);
-            }
+        else if (strncmp(buffer, "stats", 5) == 0) {
+            send_stats(client_socket);
         }
-        else if (strncmp(buffer, "getfiles", 8) == 0) {
-            char extensions[6][16];
-            int ext_count = 0;
-            char *token = strtok(buffer + 9, " ");
-            
-            while (token != NULL && ext_count < 6) {
-                strcpy(extensions[ext_count], token);
-                ext_count++;
-                token = strtok(NULL, " ");
-            }
-            
-            if (ext_count >= 1 && ext_count <= 6) {
-                char *ext_ptrs[6];
-                for (int i = 0; i < ext_count; i++) {
-                    ext_ptrs[i] = extensions[i];
-                }
-                get_files_by_extension(client_socket, ext_ptrs, ext_count);
-            } else {
-                send(client_socket, "Invalid getfiles syntax", 23, 0);
-            }
+        else if (strncmp(buffer, "ratelimit", 9) == 0) {
+            send_rate_limits(client_socket, buffer);
         }
-        else if (strncmp(buffer, "getftar", 7) == 0) {
-            char filename[256];
-            if (sscanf(buffer, "getftar %s", filename) == 1) {
-                get_file_tar(client_socket, filename);
-            } else {
-                send(client_socket, "Invalid getftar syntax", 22, 0);
-            }
+        else if (strncmp(buffer, "submit ", 7) == 0) {
+            submit_job(client_socket, raw_request + 7);
+        }
+        else if (strncmp(buffer, "status ", 7) == 0) {
+            job_status_reply(client_socket, buffer + 7);
+        }
+        else if (strncmp(buffer, "fetch ", 6) == 0) {
+            fetch_job(client_socket, buffer + 6);
+        }
+        else if (strncmp(buffer, "cancel ", 7) == 0) {
+            cancel_job(client_socket, buffer + 7);
         }
         else if (strncmp(buffer, "quit", 4) == 0) {
-            printf("Mirror: Client requested to quit\n");
+            log_event(LOG_INFO | LOG_SAMPLED, "disconnect", "\"reason\":\"quit\"");
             break;
         }
         else {
             send(client_socket, "Unknown command", 15, 0);
         }
+        
+        if (request_class >= 0) {
+            release_request(request_class);
+        }
+        log_request(cancel_reason ? "cancelled" : "ok");
     }
 }
 
 // All other functions are identical to server.c
 void find_files(int client_socket, char *filename) {
     char result_path[MAX_PATH] = {0};
-    char home_path[MAX_PATH];
     
-    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
+    // With --all or --limit every match is sent as "MATCH <path>" the
+    // moment it is found, then "END <count>"; otherwise the first match
+    int streaming = request_opts.find_all || request_opts.find_limit > 0;
+    int limit = request_opts.find_limit > 0 ? request_opts.find_limit : !request_opts.find_all;
     
-    search_directory(home_path, filename, result_path);
+    int matches = search_home(filename, limit, streaming ? client_socket : -1, result_path);
     
-    if (strlen(result_path) > 0) {
+    if (streaming) {
+        char end[48];
+        int len = snprintf(end, sizeof(end), "END %d%s\n", matches,
+                           cancel_reason == CANCEL_DEADLINE ? " deadline exceeded" : "");
+        write_all(client_socket, end, len);
+    } else if (cancel_reason) {
+        send_cancelled(client_socket);
+    } else if (strlen(result_path) > 0) {
         send(client_socket, result_path, strlen(result_path), 0);
     } else {
         send(client_socket, "File not found", 14, 0);
     }
 }
 
-void search_directory(char *dir_path, char *filename, char *result_path) {
-    DIR *dir;
+int search_directory(char *root_path, char *filename, int limit, int stream_socket, char *result_path) {
+    struct search_queue queue = {0};
+    struct ignore_file **loaded = NULL;  // children's chains point at these
+    int loaded_count = 0;
+    int matches = 0;
     struct dirent *entry;
     char full_path[MAX_PATH];
+    char line[MAX_PATH + 8];
     struct stat file_stat;
     
-    dir = opendir(dir_path);
-    if (dir == NULL) {
-        return;
-    }
+    push_search_dir(&queue, strdup(root_path), 0, NULL);
     
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    while (queue.head < queue.tail && (limit == 0 || matches < limit)) {
+        struct search_dir current = queue.entries[queue.head++];
+        
+        // Checkpoint once per directory: an abandoned walk stops here
+        if (request_cancelled()) {
+            free(current.path);
+            break;
+        }
+        
+        DIR *dir = opendir(current.path);
+        if (dir == NULL) {
+            free(current.path);
             continue;
         }
         
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        // An ignore file outlives its directory: queued subdirectories
+        // still match against it, so a copy (and the path it points at)
+        // is kept until the walk ends
+        struct ignore_file ignore_node;
+        struct ignore_file *ignores = load_ignore_file(current.path, &ignore_node, current.ignores);
+        int kept = 0;
+        if (ignores == &ignore_node) {
+            struct ignore_file **grown = realloc(loaded, (loaded_count + 1) * sizeof(*loaded));
+            struct ignore_file *copy = malloc(sizeof(struct ignore_file));
+            if (grown != NULL) {
+                loaded = grown;
+            }
+            if (grown != NULL && copy != NULL) {
+                *copy = ignore_node;
+                loaded[loaded_count++] = copy;
+                ignores = copy;
+                kept = 1;
+            } else {
+                free(copy);
+                free(ignore_node.text);
+                ignores = current.ignores;
+            }
+        }
         
-        if (stat(full_path, &file_stat) == 0) {
+        while ((entry = readdir(dir)) != NULL && (limit == 0 || matches < limit)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (prune_name(&server_rules, entry->d_name) || prune_name(&request_opts.prune, entry->d_name)) {
+                continue;
+            }
+            
+            snprintf(full_path, sizeof(full_path), "%s/%s", current.path, entry->d_name);
+            
+            if (stat(full_path, &file_stat) != 0 ||
+                is_ignored(ignores, full_path, entry->d_name, S_ISDIR(file_stat.st_mode))) {
+                continue;
+            }
             if (S_ISREG(file_stat.st_mode) && strcmp(entry->d_name, filename) == 0) {
-                strcpy(result_path, full_path);
-                closedir(dir);
-                return;
+                if (matches++ == 0) {
+                    strcpy(result_path, full_path);
+                }
+                if (stream_socket >= 0) {
+                    int len = snprintf(line, sizeof(line), "MATCH %s\n", full_path);
+                    write_all(stream_socket, line, len);
+                }
             } else if (S_ISDIR(file_stat.st_mode)) {
-                search_directory(full_path, filename, result_path);
-                if (strlen(result_path) > 0) {
-                    closedir(dir);
-                    return;
+                // Pruned before it is queued, so skipped trees cost one stat
+                if (prune_dir(&server_rules, current.depth + 1, file_stat.st_dev) ||
+                    prune_dir(&request_opts.prune, current.depth + 1, file_stat.st_dev) ||
+                    !first_visit(&search_visited, &file_stat)) {
+                    continue;
                 }
+                push_search_dir(&queue, strdup(full_path), current.depth + 1, ignores);
             }
         }
-    }
-    
-    closedir(dir);
-}
-
-void get_files_by_size(int client_socket, long size1, long size2) {
-    char files[MAX_FILES][MAX_PATH];
-    int count = 0;
-    char home_path[MAX_PATH];
-    
-    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
-    
-    search_files_by_size(home_path, size1, size2, files, &count);
-    
-    if (count > 0) {
-        char tar_command[MAX_BUFFER];
-        char tar_filename[] = "/tmp/mirror_temp.tar.gz";
-        
-        snprintf(tar_command, sizeof(tar_command), "tar -czf %s", tar_filename);
         
-        for (int i = 0; i < count; i++) {
-            strcat(tar_command, " \"");
-            strcat(tar_command, files[i]);
-            strcat(tar_command, "\"");
+        closedir(dir);
+        if (!kept) {
+            free(current.path);
         }
-        
-        system(tar_command);
-        send_tar_file(client_socket, tar_filename);
-        unlink(tar_filename);
-    } else {
-        send(client_socket, "No file found", 13, 0);
     }
-}
-
-void search_files_by_size(char *dir_path, long size1, long size2, char files[][MAX_PATH], int *count) {
-    DIR *dir;
-    struct dirent *entry;
-    char full_path[MAX_PATH];
-    struct stat file_stat;
-    
-    if (*count >= MAX_FILES) return;
     
-    dir = opendir(dir_path);
-    if (dir == NULL) {
-        return;
+    while (queue.head < queue.tail) {
+        free(queue.entries[queue.head++].path);
     }
-    
-    while ((entry = readdir(dir)) != NULL && *count < MAX_FILES) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        if (stat(full_path, &file_stat) == 0) {
-            if (S_ISREG(file_stat.st_mode)) {
-                if (file_stat.st_size >= size1 && file_stat.st_size <= size2) {
-                    strcpy(files[*count], full_path);
-                    (*count)++;
-                }
-            } else if (S_ISDIR(file_stat.st_mode)) {
-                search_files_by_size(full_path, size1, size2, files, count);
-            }
-        }
+    free(queue.entries);
+    for (int i = 0; i < loaded_count; i++) {
+        free(loaded[i]->base);
+        free(loaded[i]->text);
+        free(loaded[i]);
     }
+    free(loaded);
     
-    closedir(dir);
+    return matches;
 }
 
-void get_files_by_date(int client_socket, char *date1, char *date2) {
-    char files[MAX_FILES][MAX_PATH];
+void get_files_by_size(int client_socket, long size1, long size2) {
+    int files[MAX_FILES];
     int count = 0;
-    char home_path[MAX_PATH];
-    
-    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
     
-    search_files_by_date(home_path, date1, date2, files, &count);
+    query_index_range(file_index.by_size, 0, size1, size2, files, &count);
     
     if (count > 0) {
-        char tar_command[MAX_BUFFER];
-        char tar_filename[] = "/tmp/mirror_temp.tar.gz";
-        
-        snprintf(tar_command, sizeof(tar_command), "tar -czf %s", tar_filename);
-        
-        for (int i = 0; i < count; i++) {
-            strcat(tar_command, " \"");
-            strcat(tar_command, files[i]);
-            strcat(tar_command, "\"");
-        }
-        
-        system(tar_command);
-        send_tar_file(client_socket, tar_filename);
-        unlink(tar_filename);
+        send_archive(client_socket, files, count, NULL);
     } else {
         send(client_socket, "No file found", 13, 0);
     }
 }
 
-void search_files_by_date(char *dir_path, char *date1, char *date2, char files[][MAX_PATH], int *count) {
-    DIR *dir;
-    struct dirent *entry;
-    char full_path[MAX_PATH];
-    struct stat file_stat;
+void get_files_by_date(int client_socket, char *date1, char *date2) {
+    int files[MAX_FILES];
+    int count = 0;
     long timestamp1 = convert_date_to_timestamp(date1);
     long timestamp2 = convert_date_to_timestamp(date2);
     
-    if (*count >= MAX_FILES) return;
+    query_index_range(file_index.by_mtime, 1, timestamp1, timestamp2, files, &count);
     
-    dir = opendir(dir_path);
-    if (dir == NULL) {
-        return;
-    }
-    
-    while ((entry = readdir(dir)) != NULL && *count < MAX_FILES) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        if (stat(full_path, &file_stat) == 0) {
-            if (S_ISREG(file_stat.st_mode)) {
-                if (file_stat.st_mtime >= timestamp1 && file_stat.st_mtime <= timestamp2) {
-                    strcpy(files[*count], full_path);
-                    (*count)++;
-                }
-            } else if (S_ISDIR(file_stat.st_mode)) {
-                search_files_by_date(full_path, date1, date2, files, count);
-            }
-        }
+    if (count > 0) {
+        send_archive(client_socket, files, count, NULL);
+    } else {
+        send(client_socket, "No file found", 13, 0);
     }
-    
-    closedir(dir);
 }
 
 void get_file_tar(int client_socket, char *filename) {
     char result_path[MAX_PATH] = {0};
-    char home_path[MAX_PATH];
+    unsigned long name_key = member_name_key(filename);
     
-    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
+    // A recently requested name resolves without walking $HOME again
+    if (!lookup_cached_path(name_key, result_path)) {
+        search_home(filename, 1, -1, result_path);
+    }
     
-    search_directory(home_path, filename, result_path);
+    // A file we cannot read is reported like a missing one rather than
+    // sent as an empty archive
+    int fd = strlen(result_path) > 0 ? open(result_path, O_RDONLY) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
     
-    if (strlen(result_path) > 0) {
-        char tar_command[MAX_BUFFER];
-        char tar_filename[] = "/tmp/mirror_temp.tar.gz";
-        
-        snprintf(tar_command, sizeof(tar_command), "tar -czf %s \"%s\"", tar_filename, result_path);
-        system(tar_command);
-        
-        send_tar_file(client_socket, tar_filename);
-        unlink(tar_filename);
+    if (cancel_reason) {
+        send_cancelled(client_socket);
+    } else if (fd >= 0) {
+        send_archive(client_socket, NULL, 1, result_path);
+        remember_cached_path(name_key, result_path);
     } else {
         send(client_socket, "No file found", 13, 0);
     }
 }
 
 void get_files_by_extension(int client_socket, char **extensions, int ext_count) {
-    char files[MAX_FILES][MAX_PATH];
+    int files[MAX_FILES];
     int count = 0;
-    char home_path[MAX_PATH];
-    
-    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
     
-    search_files_by_extension(home_path, extensions, ext_count, files, &count);
+    query_index_by_extension(extensions, ext_count, files, &count);
     
     if (count > 0) {
-        char tar_command[MAX_BUFFER];
-        char tar_filename[] = "/tmp/mirror_temp.tar.gz";
-        
-        snprintf(tar_command, sizeof(tar_command), "tar -czf %s", tar_filename);
-        
-        for (int i = 0; i < count; i++) {
-            strcat(tar_command, " \"");
-            strcat(tar_command, files[i]);
-            strcat(tar_command, "\"");
-        }
-        
-        system(tar_command);
-        send_tar_file(client_socket, tar_filename);
-        unlink(tar_filename);
+        send_archive(client_socket, files, count, NULL);
     } else {
         send(client_socket, "No file found", 13, 0);
     }
 }
 
-void search_files_by_extension(char *dir_path, char **extensions, int ext_count, char files[][MAX_PATH], int *count) {
-    DIR *dir;
-    struct dirent *entry;
-    char full_path[MAX_PATH];
-    struct stat file_stat;
+void send_tar_file(int client_socket, char *tar_filename, char *tag) {
+    FILE *file = fopen(tar_filename, "rb");
+    if (file == NULL) {
+        send(client_socket, "Error creating tar file", 23, 0);
+        return;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
     
-    if (*count >= MAX_FILES) return;
+    char size_str[64];
+    snprintf(size_str, sizeof(size_str), "%ld %s%s", file_size, tag, client_is_local ? " FD" : "");
+    send(client_socket, size_str, strlen(size_str), 0);
     
-    dir = opendir(dir_path);
-    if (dir == NULL) {
+    char ack[10];
+    recv(client_socket, ack, sizeof(ack), 0);
+    
+    // Local clients are handed the open archive instead of a byte stream
+    if (client_is_local) {
+        request_bytes += file_size;
+        send_fd(client_socket, fileno(file));
+        fclose(file);
         return;
     }
     
-    while ((entry = readdir(dir)) != NULL && *count < MAX_FILES) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        if (stat(full_path, &file_stat) == 0) {
-            if (S_ISREG(file_stat.st_mode)) {
-                char *dot = strrchr(entry->d_name, '.');
-                if (dot != NULL) {
-                    for (int i = 0; i < ext_count; i++) {
-                        if (strcmp(dot + 1, extensions[i]) == 0) {
-                            strcpy(files[*count], full_path);
-                            (*count)++;
-                            break;
-                        }
-                    }
-                }
-            } else if (S_ISDIR(file_stat.st_mode)) {
-                search_files_by_extension(full_path, extensions, ext_count, files, count);
-            }
-        }
-    }
-    
-    closedir(dir);
-}
-
-void send_tar_file(int client_socket, char *tar_filename) {
-    FILE *file = fopen(tar_filename, "rb");
-    if (file == NULL) {
-        send(client_socket, "Error creating tar file", 23, 0);
-        return;
-    }
-    
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    char size_str[32];
-    snprintf(size_str, sizeof(size_str), "%ld", file_size);
-    send(client_socket, size_str, strlen(size_str), 0);
-    
-    char ack[10];
-    recv(client_socket, ack, sizeof(ack), 0);
-    
     char buffer[MAX_BUFFER];
     size_t bytes_read;
     
+    begin_transfer();
     while ((bytes_read = fread(buffer, 1, MAX_BUFFER, file)) > 0) {
+        pace_transfer(bytes_read);
         send(client_socket, buffer, bytes_read, 0);
     }
+    end_transfer();
     
     fclose(file);
 }
@@ -510,4 +1076,3483 @@ long convert_date_to_timestamp(char *date) {
     tm.tm_year -= 1900;
     tm.tm_mon -= 1;
     return mktime(&tm);
-}
\ No newline at end of file
+}
+
+// Walk home_path into next_index, copying the listings of unchanged
+// directories from the live index, which keeps serving until the walk is
+// done and swap_file_index() replaces it
+void build_file_index(char *home_path) {
+    int full_scan = file_index.dir_count == 0 || time(NULL) - file_index.full_scan_at >= full_rescan_interval;
+    
+    memset(&next_index, 0, sizeof(next_index));
+    previous_index = full_scan ? NULL : &file_index;
+    
+    struct stat home_stat;
+    if (stat(home_path, &home_stat) < 0) {
+        memset(&home_stat, 0, sizeof(home_stat));
+    }
+    home_dev = home_stat.st_dev;
+    begin_walk(&index_visited, home_path);
+    index_directory(home_path, add_dir_node(-1, home_path, &home_stat, full_scan ? -1 : 0), NULL);
+    previous_index = NULL;
+    
+    // Columnar sort orders over the entries, searched with binary search
+    next_index.by_size = malloc(sizeof(int) * (next_index.count + 1));
+    next_index.by_mtime = malloc(sizeof(int) * (next_index.count + 1));
+    if (next_index.by_size == NULL || next_index.by_mtime == NULL) {
+        perror("index malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < next_index.count; i++) {
+        next_index.by_size[i] = i;
+        next_index.by_mtime[i] = i;
+    }
+    qsort(next_index.by_size, next_index.count, sizeof(int), compare_by_size);
+    qsort(next_index.by_mtime, next_index.count, sizeof(int), compare_by_mtime);
+    build_name_filter();
+    
+    next_index.built_at = time(NULL);
+    next_index.full_scan_at = full_scan ? next_index.built_at : file_index.full_scan_at;
+    next_index.generation = file_index.generation + 1;
+}
+
+// Replace the live index with the finished next_index in one step
+void swap_file_index() {
+    struct file_index old = file_index;
+    file_index = next_index;
+    memset(&next_index, 0, sizeof(next_index));
+    free_index(&old);
+}
+
+// List dir_id (read or copied), then descend into the subdirectories it
+// just interned. Children are interned before any recursion, so every
+// directory's files and subdirectories occupy contiguous id ranges.
+void index_directory(char *dir_path, int dir_id, struct ignore_file *ignores) {
+    char full_path[MAX_PATH];
+    struct ignore_file ignore_node;
+    int old_id = next_index.dirs[dir_id].old;
+    
+    ignores = load_ignore_file(dir_path, &ignore_node, ignores);
+    next_index.dirs[dir_id].ignore_mtime = ignores == &ignore_node ? ignore_node.mtime : 0;
+    
+    // An edited ignore file changes what everything below it lists
+    if (old_id >= 0 && previous_index->dirs[old_id].ignore_mtime != next_index.dirs[dir_id].ignore_mtime) {
+        old_id = -1;
+    }
+    
+    if (old_id >= 0 && directory_unchanged(dir_id, old_id)) {
+        copy_directory_listing(dir_path, dir_id, old_id);
+    } else {
+        read_directory_listing(dir_path, dir_id, ignores, old_id);
+    }
+    
+    int first = next_index.dirs[dir_id].first_child;
+    int last = first + next_index.dirs[dir_id].child_count;
+    for (int c = first; c < last; c++) {
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, next_index.dirs[c].name);
+        index_directory(full_path, c, ignores);
+    }
+    
+    if (ignores == &ignore_node) {
+        free(ignore_node.text);
+    }
+}
+
+// readdir + stat of one directory. Subdirectories are matched by name to
+// their node in the previous index so their own listings can be reused.
+void read_directory_listing(char *dir_path, int dir_id, struct ignore_file *ignores, int old_id) {
+    DIR *dir;
+    struct dirent *entry;
+    char full_path[MAX_PATH];
+    struct stat file_stat;
+    int cursor = 0;
+    
+    next_index.dirs[dir_id].first_entry = next_index.count;
+    next_index.dirs[dir_id].first_child = next_index.dir_count;
+    
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (prune_name(&server_rules, entry->d_name)) {
+            continue;
+        }
+        
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        
+        if (stat(full_path, &file_stat) == 0) {
+            if (is_ignored(ignores, full_path, entry->d_name, S_ISDIR(file_stat.st_mode))) {
+                continue;
+            }
+            if (S_ISREG(file_stat.st_mode)) {
+                add_ext_posting(entry->d_name, next_index.count);
+                add_index_entry(dir_id, entry->d_name, file_stat.st_size, file_stat.st_mtime);
+            } else if (S_ISDIR(file_stat.st_mode)) {
+                if (prune_dir(&server_rules, next_index.dirs[dir_id].depth + 1, file_stat.st_dev) ||
+                    !first_visit(&index_visited, &file_stat)) {
+                    continue;
+                }
+                add_dir_node(dir_id, entry->d_name, &file_stat, find_old_child(old_id, entry->d_name, &cursor));
+            }
+        }
+    }
+    
+    closedir(dir);
+    next_index.dirs[dir_id].entry_count = next_index.count - next_index.dirs[dir_id].first_entry;
+    next_index.dirs[dir_id].child_count = next_index.dir_count - next_index.dirs[dir_id].first_child;
+}
+
+// The directory's own entries are unchanged: take its files from the
+// previous index and only stat() its subdirectories, whose mtime decides
+// whether they in turn must be read
+void copy_directory_listing(char *dir_path, int dir_id, int old_id) {
+    struct dir_node *old_dir = &previous_index->dirs[old_id];
+    char full_path[MAX_PATH];
+    struct stat dir_stat;
+    
+    next_index.dirs[dir_id].first_entry = next_index.count;
+    for (int i = old_dir->first_entry; i < old_dir->first_entry + old_dir->entry_count; i++) {
+        struct file_entry *e = &previous_index->entries[i];
+        add_ext_posting(e->name, next_index.count);
+        add_index_entry(dir_id, e->name, e->size, e->mtime);
+    }
+    next_index.dirs[dir_id].entry_count = old_dir->entry_count;
+    
+    next_index.dirs[dir_id].first_child = next_index.dir_count;
+    for (int c = old_dir->first_child; c < old_dir->first_child + old_dir->child_count; c++) {
+        char *name = previous_index->dirs[c].name;
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, name);
+        
+        // Something may have been mounted over it since
+        if (stat(full_path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode) &&
+            !prune_dir(&server_rules, next_index.dirs[dir_id].depth + 1, dir_stat.st_dev) &&
+            first_visit(&index_visited, &dir_stat)) {
+            add_dir_node(dir_id, name, &dir_stat, c);
+        }
+    }
+    next_index.dirs[dir_id].child_count = next_index.dir_count - next_index.dirs[dir_id].first_child;
+}
+
+// A change within the second of the previous scan might not have moved the
+// mtime, so such directories are read again (as git does for racy entries)
+int directory_unchanged(int dir_id, int old_id) {
+    struct dir_node *d = &next_index.dirs[dir_id];
+    struct dir_node *old_dir = &previous_index->dirs[old_id];
+    
+    return d->mtime == old_dir->mtime && d->ctime == old_dir->ctime &&
+           d->mtime < previous_index->built_at;
+}
+
+// Old node of the subdirectory called name, searching from where the last
+// match left off since readdir() order rarely changes between scans
+int find_old_child(int old_id, char *name, int *cursor) {
+    if (old_id < 0) {
+        return -1;
+    }
+    
+    struct dir_node *old_dir = &previous_index->dirs[old_id];
+    for (int i = 0; i < old_dir->child_count; i++) {
+        int pos = (*cursor + i) % old_dir->child_count;
+        if (strcmp(previous_index->dirs[old_dir->first_child + pos].name, name) == 0) {
+            *cursor = pos + 1;
+            return old_dir->first_child + pos;
+        }
+    }
+    
+    return -1;
+}
+
+void add_index_entry(int dir_id, char *name, long size, time_t mtime) {
+    if (next_index.count == next_index.capacity) {
+        int capacity = next_index.capacity ? next_index.capacity * 2 : INDEX_INITIAL_CAPACITY;
+        struct file_entry *entries = realloc(next_index.entries, sizeof(struct file_entry) * capacity);
+        if (entries == NULL) {
+            perror("index realloc");
+            exit(EXIT_FAILURE);
+        }
+        next_index.entries = entries;
+        next_index.capacity = capacity;
+    }
+    
+    struct file_entry *e = &next_index.entries[next_index.count];
+    e->dir = dir_id;
+    e->name = arena_strdup(name);
+    e->size = size;
+    e->mtime = mtime;
+    next_index.count++;
+}
+
+int add_dir_node(int parent, char *name, struct stat *dir_stat, int old_id) {
+    if (next_index.dir_count == next_index.dir_capacity) {
+        int capacity = next_index.dir_capacity ? next_index.dir_capacity * 2 : INDEX_INITIAL_CAPACITY;
+        struct dir_node *dirs = realloc(next_index.dirs, sizeof(struct dir_node) * capacity);
+        if (dirs == NULL) {
+            perror("index realloc");
+            exit(EXIT_FAILURE);
+        }
+        next_index.dirs = dirs;
+        next_index.dir_capacity = capacity;
+    }
+    
+    struct dir_node *d = &next_index.dirs[next_index.dir_count];
+    memset(d, 0, sizeof(*d));
+    d->parent = parent;
+    d->name = arena_strdup(name);
+    d->depth = parent < 0 ? 0 : next_index.dirs[parent].depth + 1;
+    d->dev = dir_stat->st_dev;
+    d->mtime = dir_stat->st_mtime;
+    d->ctime = dir_stat->st_ctime;
+    d->old = old_id;
+    return next_index.dir_count++;
+}
+
+char *arena_strdup(char *s) {
+    size_t len = strlen(s) + 1;
+    struct arena_block *block = next_index.arena;
+    
+    if (block == NULL || block->used + len > block->size) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + size);
+        if (block == NULL) {
+            perror("index arena");
+            exit(EXIT_FAILURE);
+        }
+        block->next = next_index.arena;
+        block->used = 0;
+        block->size = size;
+        next_index.arena = block;
+    }
+    
+    char *copy = block->data + block->used;
+    memcpy(copy, s, len);
+    block->used += len;
+    return copy;
+}
+
+void free_index(struct file_index *index) {
+    while (index->arena != NULL) {
+        struct arena_block *next = index->arena->next;
+        free(index->arena);
+        index->arena = next;
+    }
+    for (int i = 0; i < index->ext_slots; i++) {
+        free(index->ext_table[i].ids);
+    }
+    free(index->ext_table);
+    free(index->entries);
+    free(index->dirs);
+    free(index->by_size);
+    free(index->by_mtime);
+    free(index->name_filter);
+}
+
+// Materialize a directory path into buffer; returns the untruncated length
+int index_dir_path(int dir_id, char *buffer, int size) {
+    struct dir_node *d = &file_index.dirs[dir_id];
+    
+    if (d->parent < 0) {
+        return snprintf(buffer, size, "%s", d->name);
+    }
+    
+    int len = index_dir_path(d->parent, buffer, size);
+    if (len < size) {
+        len += snprintf(buffer + len, size - len, "/%s", d->name);
+    }
+    return len;
+}
+
+// Materialize the full path of entry id into a MAX_PATH buffer
+void index_entry_path(int id, char *buffer) {
+    struct file_entry *e = &file_index.entries[id];
+    int len = index_dir_path(e->dir, buffer, MAX_PATH);
+    
+    if (len < MAX_PATH) {
+        snprintf(buffer + len, MAX_PATH - len, "/%s", e->name);
+    }
+}
+
+// Equal keys keep entry id order, so qsort's result does not depend on
+// how it happens to shuffle ties
+int compare_by_size(const void *a, const void *b) {
+    int i = *(const int *)a, j = *(const int *)b;
+    long x = next_index.entries[i].size;
+    long y = next_index.entries[j].size;
+    return x != y ? (x > y) - (x < y) : (i > j) - (i < j);
+}
+
+int compare_by_mtime(const void *a, const void *b) {
+    int i = *(const int *)a, j = *(const int *)b;
+    time_t x = next_index.entries[i].mtime;
+    time_t y = next_index.entries[j].mtime;
+    return x != y ? (x > y) - (x < y) : (i > j) - (i < j);
+}
+
+long index_key(int id, int use_mtime) {
+    return use_mtime ? (long)file_index.entries[id].mtime : file_index.entries[id].size;
+}
+
+// First position in order[] whose key is >= value
+int index_lower_bound(int *order, int use_mtime, long value) {
+    int lo = 0, hi = file_index.count;
+    
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (index_key(order[mid], use_mtime) < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+// Collect entries with low <= key <= high in O(log n + k)
+void query_index_range(int *order, int use_mtime, long low, long high, int *files, int *count) {
+    if (file_index.count == 0) return;
+    
+    for (int i = index_lower_bound(order, use_mtime, low); i < file_index.count; i++) {
+        int id = order[i];
+        if (index_key(id, use_mtime) > high) break;
+        if (entry_visible(id)) {
+            if (*count == MAX_FILES) {
+                query_truncated = 1;
+                break;
+            }
+            files[(*count)++] = id;
+        }
+    }
+}
+
+// FNV-1a over the already lower-cased extension
+unsigned long hash_extension(char *ext) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    for (; *ext; ext++) {
+        hash ^= (unsigned char)*ext;
+        hash *= 1099511628211UL;
+    }
+    
+    return hash;
+}
+
+// Linear probe to the slot holding ext, or the free slot where it belongs
+struct ext_posting *find_ext_slot(struct ext_posting *table, int slots, char *ext) {
+    int i = hash_extension(ext) & (slots - 1);
+    
+    while (table[i].ext[0] != '\0' && strcmp(table[i].ext, ext) != 0) {
+        i = (i + 1) & (slots - 1);
+    }
+    
+    return &table[i];
+}
+
+void grow_ext_table() {
+    int slots = next_index.ext_slots ? next_index.ext_slots * 2 : EXT_TABLE_INITIAL_SLOTS;
+    struct ext_posting *table = calloc(slots, sizeof(struct ext_posting));
+    if (table == NULL) {
+        perror("index calloc");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < next_index.ext_slots; i++) {
+        if (next_index.ext_table[i].ext[0] != '\0') {
+            *find_ext_slot(table, slots, next_index.ext_table[i].ext) = next_index.ext_table[i];
+        }
+    }
+    
+    free(next_index.ext_table);
+    next_index.ext_table = table;
+    next_index.ext_slots = slots;
+}
+
+// Lower-case ext into out; returns 0 if it is empty or too long to index
+int normalize_extension(char *ext, char *out) {
+    int len = strlen(ext);
+    
+    if (len == 0 || len >= MAX_EXTENSION) return 0;
+    
+    for (int i = 0; i <= len; i++) {
+        out[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] - 'A' + 'a' : ext[i];
+    }
+    
+    return 1;
+}
+
+void add_ext_posting(char *filename, int id) {
+    char ext[MAX_EXTENSION];
+    char *dot = strrchr(filename, '.');
+    
+    if (dot == NULL || !normalize_extension(dot + 1, ext)) return;
+    
+    // Keep the load factor under 3/4 so probe chains stay short
+    if ((next_index.ext_used + 1) * 4 > next_index.ext_slots * 3) {
+        grow_ext_table();
+    }
+    
+    struct ext_posting *p = find_ext_slot(next_index.ext_table, next_index.ext_slots, ext);
+    if (p->ext[0] == '\0') {
+        strcpy(p->ext, ext);
+        next_index.ext_used++;
+    }
+    
+    if (p->count == p->capacity) {
+        int capacity = p->capacity ? p->capacity * 2 : 16;
+        int *ids = realloc(p->ids, sizeof(int) * capacity);
+        if (ids == NULL) {
+            perror("index realloc");
+            exit(EXIT_FAILURE);
+        }
+        p->ids = ids;
+        p->capacity = capacity;
+    }
+    
+    // Entries are appended in id order, so every posting list stays sorted
+    p->ids[p->count++] = id;
+}
+
+// k-way merge of the sorted posting lists of the requested extensions
+void query_index_by_extension(char **extensions, int ext_count, int *files, int *count) {
+    struct ext_posting *lists[6];
+    int pos[6] = {0};
+    int k = 0;
+    
+    if (file_index.ext_slots == 0) return;
+    
+    for (int i = 0; i < ext_count && k < 6; i++) {
+        char ext[MAX_EXTENSION];
+        if (!normalize_extension(extensions[i], ext)) continue;
+        
+        struct ext_posting *p = find_ext_slot(file_index.ext_table, file_index.ext_slots, ext);
+        if (p->ext[0] != '\0') {
+            lists[k++] = p;
+        }
+    }
+    
+    int last_id = -1;
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] < lists[i]->count &&
+                (best < 0 || lists[i]->ids[pos[i]] < lists[best]->ids[pos[best]])) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        
+        int id = lists[best]->ids[pos[best]++];
+        if (id == last_id) continue;  // same extension requested twice
+        last_id = id;
+        if (entry_visible(id)) {
+            if (*count == MAX_FILES) {
+                query_truncated = 1;
+                break;
+            }
+            files[(*count)++] = id;
+        }
+    }
+}
+
+// Stream index entries files[] (or, when files is NULL, the single path)
+// into tar_filename as a gzip-compressed tar archive
+int create_tar_archive(char *tar_filename, int *files, int count, char *path) {
+    struct archive_member window[ARCHIVE_QUEUE_DEPTH];
+    int head = 0, queued = 0, next = 0;
+    int status = 0;
+    long input = 0, overhead = GZIP_STREAM_OVERHEAD;
+    pid_t gzip_pid;
+    
+    if (files == NULL) {
+        return create_single_archive(tar_filename, path);
+    }
+    
+    // Dedup mode: members whose contents match an earlier member become hard links
+    int *link_to = NULL;
+    char *written = NULL;
+    if (request_opts.dedup && files != NULL) {
+        link_to = malloc(sizeof(int) * count);
+        written = calloc(count, 1);
+        if (link_to == NULL || written == NULL) {
+            free(link_to);
+            free(written);
+            return -1;
+        }
+        find_duplicates(files, count, link_to);
+    }
+    
+    int out_fd = start_gzip(tar_filename, &gzip_pid);
+    if (out_fd < 0) {
+        free(link_to);
+        free(written);
+        return -1;
+    }
+    
+    while (head < count) {
+        // Keep up to ARCHIVE_QUEUE_DEPTH members opened ahead with read-ahead
+        // requested, so the kernel fetches them while earlier ones are written
+        while (next < count && queued < ARCHIVE_QUEUE_DEPTH) {
+            struct archive_member *m = &window[next % ARCHIVE_QUEUE_DEPTH];
+            index_entry_path(files[next], m->path);
+            open_archive_member(m);
+            next++;
+            queued++;
+        }
+        
+        struct archive_member *m = &window[head % ARCHIVE_QUEUE_DEPTH];
+        if (status == 0 && build_cancelled()) {
+            status = -1;
+        }
+        if (m->fd >= 0) {
+            int original = link_to ? link_to[head] : -1;
+            if (status == 0 && original >= 0 && written[original]) {
+                status = write_hard_link(out_fd, m, files[original]);
+            } else if (status == 0) {
+                status = write_archive_member(out_fd, m);
+                if (written != NULL && status == 0) {
+                    written[head] = 1;
+                }
+                input += m->st.st_size;
+                overhead += member_overhead(m->path);
+            }
+            close(m->fd);
+        }
+        head++;
+        queued--;
+    }
+    free(link_to);
+    free(written);
+    
+    // End of archive: two zero blocks, left to the last shard of a split
+    char trailer[TAR_BLOCK * 2] = {0};
+    if (status == 0 && !request_opts.open_ended && write_all(out_fd, trailer, sizeof(trailer)) < 0) {
+        status = -1;
+    }
+    
+    close(out_fd);
+    int gzip_status;
+    if (waitpid(gzip_pid, &gzip_status, 0) < 0 || !WIFEXITED(gzip_status) || WEXITSTATUS(gzip_status) != 0) {
+        status = -1;
+    }
+    
+    // Hard links would make dedup archives look more compressible than they are
+    if (status == 0 && !request_opts.dedup) {
+        learn_compression(input, overhead, tar_filename);
+    }
+    if (status < 0) {
+        unlink(tar_filename);
+    }
+    return status;
+}
+
+// Fork gzip writing into tar_filename; returns the fd feeding its stdin
+int start_gzip(char *tar_filename, pid_t *pid) {
+    int pipe_fds[2];
+    
+    int file_fd = open(tar_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0) {
+        perror("open archive");
+        return -1;
+    }
+    
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        close(file_fd);
+        return -1;
+    }
+    
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipe_fds[0], STDIN_FILENO);
+        dup2(file_fd, STDOUT_FILENO);
+        // Compression yields the CPU to interactive requests
+        if (nice(ARCHIVE_NICE) < 0) {
+            perror("nice");
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(file_fd);
+        // -n and --rsyncable keep unchanged members byte-identical between
+        // builds, which is what makes delta transfers effective
+        execlp("gzip", "gzip", "-c", "-n", "--rsyncable", NULL);
+        _exit(127);
+    }
+    
+    close(pipe_fds[0]);
+    close(file_fd);
+    if (*pid < 0) {
+        perror("fork gzip");
+        close(pipe_fds[1]);
+        return -1;
+    }
+    
+    return pipe_fds[1];
+}
+
+void open_archive_member(struct archive_member *m) {
+    m->fd = open(m->path, O_RDONLY);
+    if (m->fd < 0) {
+        return;
+    }
+    
+    if (fstat(m->fd, &m->st) < 0 || !S_ISREG(m->st.st_mode)) {
+        close(m->fd);
+        m->fd = -1;
+        return;
+    }
+    
+    posix_fadvise(m->fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+int write_archive_member(int out_fd, struct archive_member *m) {
+    char buffer[MAX_BUFFER * 16];
+    long remaining = m->st.st_size;
+    
+    char *name = tar_member_name(m->path);
+    
+    if (write_tar_header(out_fd, name, &m->st, '0', NULL) < 0) {
+        return -1;
+    }
+    
+    while (remaining > 0) {
+        if (build_cancelled()) {
+            return -1;
+        }
+        long want = remaining < (long)sizeof(buffer) ? remaining : (long)sizeof(buffer);
+        ssize_t n = read(m->fd, buffer, want);
+        if (n <= 0) {
+            // File shrank since fstat: pad to the size already in the header
+            n = want;
+            memset(buffer, 0, n);
+        }
+        if (write_all(out_fd, buffer, n) < 0) {
+            return -1;
+        }
+        remaining -= n;
+    }
+    
+    return write_tar_padding(out_fd, m->st.st_size);
+}
+
+int write_tar_header(int out_fd, char *name, struct stat *st, char typeflag, char *linkname) {
+    char header[TAR_BLOCK];
+    long size = (typeflag == '0') ? st->st_size : 0;
+    
+    // GNU long-name extensions for names that do not fit the 100-byte fields
+    if (strlen(name) >= 100 && write_long_name(out_fd, 'L', name) < 0) {
+        return -1;
+    }
+    if (linkname != NULL && strlen(linkname) >= 100 && write_long_name(out_fd, 'K', linkname) < 0) {
+        return -1;
+    }
+    if (typeflag == 'L' || typeflag == 'K') {
+        size = st->st_size;
+    }
+    
+    memset(header, 0, sizeof(header));
+    strncpy(header, name, 99);
+    snprintf(header + 100, 8, "%07o", (unsigned int)(st->st_mode & 07777));
+    snprintf(header + 108, 8, "%07o", (unsigned int)st->st_uid);
+    snprintf(header + 116, 8, "%07o", (unsigned int)st->st_gid);
+    write_tar_number(header + 124, 12, size);
+    write_tar_number(header + 136, 12, st->st_mtime);
+    header[156] = typeflag;
+    if (linkname != NULL) {
+        strncpy(header + 157, linkname, 99);
+    }
+    memcpy(header + 257, "ustar  ", 8);
+    
+    if (typeflag != 'L' && typeflag != 'K') {
+        struct passwd *pw = getpwuid(st->st_uid);
+        struct group *gr = getgrgid(st->st_gid);
+        if (pw != NULL) strncpy(header + 265, pw->pw_name, 31);
+        if (gr != NULL) strncpy(header + 297, gr->gr_name, 31);
+    }
+    
+    // Checksum is computed with the checksum field itself set to spaces
+    unsigned int checksum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+    
+    return write_all(out_fd, header, TAR_BLOCK);
+}
+
+int write_long_name(int out_fd, char typeflag, char *value) {
+    struct stat long_st = {0};
+    long_st.st_size = strlen(value) + 1;
+    
+    if (write_tar_header(out_fd, "././@LongLink", &long_st, typeflag, NULL) < 0 ||
+        write_all(out_fd, value, long_st.st_size) < 0 ||
+        write_tar_padding(out_fd, long_st.st_size) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int write_hard_link(int out_fd, struct archive_member *m, int original_id) {
+    char original[MAX_PATH];
+    char *name = m->path;
+    char *linkname = original;
+    
+    index_entry_path(original_id, original);
+    name = tar_member_name(name);
+    linkname = tar_member_name(linkname);
+    
+    return write_tar_header(out_fd, name, &m->st, '1', linkname);
+}
+
+int compare_candidates(const void *a, const void *b) {
+    const struct dedup_candidate *x = a, *y = b;
+    
+    if (x->size != y->size) {
+        return (x->size > y->size) - (x->size < y->size);
+    }
+    return x->pos - y->pos;
+}
+
+unsigned long hash_file(char *path) {
+    unsigned long hash = 1469598103934665603UL;
+    char buffer[MAX_BUFFER * 16];
+    ssize_t n;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        hash = hash_bytes(hash, buffer, n);
+    }
+    close(fd);
+    
+    return hash;
+}
+
+int same_contents(char *path1, char *path2) {
+    char buffer1[MAX_BUFFER * 4], buffer2[MAX_BUFFER * 4];
+    int same = 0;
+    
+    FILE *file1 = fopen(path1, "rb");
+    FILE *file2 = fopen(path2, "rb");
+    if (file1 != NULL && file2 != NULL) {
+        size_t n1, n2;
+        do {
+            n1 = fread(buffer1, 1, sizeof(buffer1), file1);
+            n2 = fread(buffer2, 1, sizeof(buffer2), file2);
+        } while (n1 == n2 && n1 > 0 && memcmp(buffer1, buffer2, n1) == 0);
+        same = (n1 == 0 && n2 == 0);
+    }
+    
+    if (file1 != NULL) fclose(file1);
+    if (file2 != NULL) fclose(file2);
+    return same;
+}
+
+// link_to[i] = position of the earlier member with identical contents, or -1.
+// Only members sharing a size with another member are hashed, and a hash
+// match is confirmed byte for byte before it is trusted.
+void find_duplicates(int *files, int count, int *link_to) {
+    struct dedup_candidate *c = malloc(sizeof(struct dedup_candidate) * count);
+    char path1[MAX_PATH], path2[MAX_PATH];
+    
+    for (int i = 0; i < count; i++) {
+        link_to[i] = -1;
+    }
+    if (c == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        c[i].size = file_index.entries[files[i]].size;
+        c[i].pos = i;
+        c[i].hash = 0;
+    }
+    qsort(c, count, sizeof(struct dedup_candidate), compare_candidates);
+    
+    for (int start = 0; start < count; ) {
+        int end = start + 1;
+        while (end < count && c[end].size == c[start].size) end++;
+        
+        if (end - start > 1 && c[start].size > 0) {
+            for (int i = start; i < end; i++) {
+                index_entry_path(files[c[i].pos], path1);
+                c[i].hash = hash_file(path1);
+            }
+            for (int i = start + 1; i < end; i++) {
+                for (int j = start; j < i; j++) {
+                    if (c[j].hash != c[i].hash || link_to[c[j].pos] >= 0) continue;
+                    
+                    index_entry_path(files[c[i].pos], path1);
+                    index_entry_path(files[c[j].pos], path2);
+                    if (same_contents(path1, path2)) {
+                        link_to[c[i].pos] = c[j].pos;
+                        break;
+                    }
+                }
+            }
+        }
+        start = end;
+    }
+    
+    free(c);
+}
+
+// Octal when it fits, GNU base-256 otherwise (files of 8 GiB and more)
+void write_tar_number(char *field, int width, long value) {
+    if (value >= 0 && value < (1L << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*lo", width - 1, (unsigned long)value);
+        return;
+    }
+    
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (int i = width - 1; i > 0 && value != 0; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+int write_tar_padding(int out_fd, long size) {
+    char zeros[TAR_BLOCK] = {0};
+    long pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    
+    return pad ? write_all(out_fd, zeros, pad) : 0;
+}
+
+int write_all(int fd, char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Returns the listening fd, or -1 (and the server runs TCP-only)
+int listen_unix_socket(char *path) {
+    struct sockaddr_un addr;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("unix socket");
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    
+    // Owner only from the moment it exists: connecting here is what makes
+    // a client local, and local clients may change the rate limits
+    mode_t old_mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(fd, config_int("FS_LISTEN_BACKLOG", LISTEN_BACKLOG)) < 0) {
+        perror("unix bind");
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+// Pass fd to the peer with SCM_RIGHTS; the kernel keeps the file alive
+// even if we close and unlink it right after
+int send_fd(int socket, int fd) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    char marker = 'F';
+    char control[CMSG_SPACE(sizeof(int))];
+    
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    return sendmsg(socket, &msg, 0) == 1 ? 0 : -1;
+}
+
+int config_int(char *name, int default_value) {
+    char *value = getenv(name);
+    
+    if (value == NULL || *value == '\0') {
+        return default_value;
+    }
+    
+    return atoi(value);
+}
+
+void init_shared_state() {
+    int reused;
+    
+    shared = map_shared("FS_SHARED_FD", sizeof(struct shared_state), &shared_fd, &reused);
+    if (shared == MAP_FAILED) {
+        perror("mmap shared state");
+        exit(EXIT_FAILURE);
+    }
+    
+    // After a reload, builds in flight and admission counts carry on
+    if (!reused) {
+        memset(shared, 0, sizeof(struct shared_state));
+        
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&shared->lock, &attr);
+        pthread_mutex_init(&shared->ratio_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    
+    max_active[CLASS_METADATA] = config_int("FS_MAX_METADATA", max_active[CLASS_METADATA]);
+    max_active[CLASS_ARCHIVE] = config_int("FS_MAX_ARCHIVE", max_active[CLASS_ARCHIVE]);
+    max_waiting[CLASS_METADATA] = config_int("FS_QUEUE_METADATA", max_waiting[CLASS_METADATA]);
+    max_waiting[CLASS_ARCHIVE] = config_int("FS_QUEUE_ARCHIVE", max_waiting[CLASS_ARCHIVE]);
+    retry_after_ms = config_int("FS_RETRY_AFTER_MS", retry_after_ms);
+    
+    // Runtime changes made with "ratelimit" survive a reload
+    if (!reused) {
+        shared->rate_conn = (long)config_int("FS_RATE_CONN_KBPS", 0) * 1024;
+        shared->rate_ip = (long)config_int("FS_RATE_IP_KBPS", 0) * 1024;
+        shared->rate_total = (long)config_int("FS_RATE_TOTAL_KBPS", 0) * 1024;
+    }
+}
+
+// Cheap lookups versus commands that walk, read and compress many files
+int command_class(char *command) {
+    if (strncmp(command, "findfile", 8) == 0) {
+        return CLASS_METADATA;
+    }
+    if (strncmp(command, "sgetfiles", 9) == 0 || strncmp(command, "dgetfiles", 9) == 0 ||
+        strncmp(command, "getfiles", 8) == 0 || strncmp(command, "getftar", 7) == 0) {
+        return CLASS_ARCHIVE;
+    }
+    return -1;
+}
+
+// Atomically increment counter if it is below limit
+int try_acquire(int *counter, int limit) {
+    int current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    
+    while (current < limit) {
+        if (__atomic_compare_exchange_n(counter, &current, current + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int admit_request(int request_class) {
+    if (try_acquire(&shared->active[request_class], max_active[request_class])) {
+        return 1;
+    }
+    
+    // Bounded queue: wait up to QUEUE_TIMEOUT_MS for a running request to finish
+    if (!try_acquire(&shared->waiting[request_class], max_waiting[request_class])) {
+        return 0;
+    }
+    
+    int admitted = 0;
+    for (int waited = 0; waited < QUEUE_TIMEOUT_MS && !admitted && !request_cancelled(); waited += 10) {
+        usleep(10000);
+        admitted = try_acquire(&shared->active[request_class], max_active[request_class]);
+    }
+    
+    __atomic_fetch_sub(&shared->waiting[request_class], 1, __ATOMIC_ACQ_REL);
+    return admitted;
+}
+
+void release_request(int request_class) {
+    __atomic_fetch_sub(&shared->active[request_class], 1, __ATOMIC_ACQ_REL);
+}
+
+// FNV-1a, continued from hash
+unsigned long hash_bytes(unsigned long hash, void *data, size_t len) {
+    unsigned char *p = data;
+    
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211UL;
+    }
+    
+    return hash;
+}
+
+// Identical result sets from the same index generation build identical archives
+unsigned long archive_key(int *files, int count, char *path) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    if (files != NULL) {
+        hash = hash_bytes(hash, &file_index.generation, sizeof(file_index.generation));
+        hash = hash_bytes(hash, &request_opts.dedup, sizeof(request_opts.dedup));
+        hash = hash_bytes(hash, &request_opts.open_ended, sizeof(request_opts.open_ended));
+        hash = hash_bytes(hash, files, sizeof(int) * count);
+    } else {
+        hash = hash_bytes(hash, path, strlen(path));
+    }
+    
+    return hash ? hash : 1;
+}
+
+// Attach to the build for key, or claim a slot and become its builder.
+// Returns the slot, or -1 when the table is full and the caller builds alone.
+int join_build(unsigned long key, int *leader) {
+    int slot = -1;
+    
+    pthread_mutex_lock(&shared->lock);
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        if (shared->builds[i].key == key && shared->builds[i].state != BUILD_FAILED) {
+            shared->builds[i].refs++;
+            *leader = 0;
+            pthread_mutex_unlock(&shared->lock);
+            return i;
+        }
+        if (slot < 0 && shared->builds[i].key == 0) {
+            slot = i;
+        }
+    }
+    
+    if (slot >= 0) {
+        struct inflight_build *b = &shared->builds[slot];
+        b->key = key;
+        b->state = BUILD_RUNNING;
+        b->refs = 1;
+        b->builder = getpid();
+        snprintf(b->tar_filename, sizeof(b->tar_filename), "%s.%d.tar.gz", ARCHIVE_PREFIX, (int)getpid());
+    }
+    *leader = 1;
+    pthread_mutex_unlock(&shared->lock);
+    return slot;
+}
+
+// Record the outcome of the build of key by builder, unless the slot has
+// since been freed and claimed by another build
+void finish_build(int slot, unsigned long key, pid_t builder, int status) {
+    pthread_mutex_lock(&shared->lock);
+    struct inflight_build *b = &shared->builds[slot];
+    if (b->key == key && b->builder == builder) {
+        b->state = (status == 0) ? BUILD_DONE : BUILD_FAILED;
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Block until the builder of slot is done; returns its final state
+int wait_for_build(int slot) {
+    struct inflight_build *b = &shared->builds[slot];
+    int state;
+    
+    while ((state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE)) == BUILD_RUNNING) {
+        // A builder that died without finishing fails the build for everyone
+        pid_t builder = b->builder;
+        if (kill(builder, 0) < 0 && errno == ESRCH) {
+            finish_build(slot, b->key, builder, -1);
+            return BUILD_FAILED;
+        }
+        // Our own client left or ran out of time; the build goes on for others
+        if (request_cancelled()) {
+            return BUILD_FAILED;
+        }
+        usleep(10000);
+    }
+    
+    return state;
+}
+
+// Drop a reference; the last request out removes the archive and frees the slot
+void leave_build(int slot) {
+    pthread_mutex_lock(&shared->lock);
+    struct inflight_build *b = &shared->builds[slot];
+    if (--b->refs == 0) {
+        unlink(b->tar_filename);
+        b->key = 0;
+        b->state = 0;
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Build (or attach to an identical in-flight build of) an archive and send it
+void send_archive(int client_socket, int *files, int count, char *path) {
+    char tag[MAX_TAG];
+    int leader;
+    
+    // --split: build only this node's part; the other node builds the rest
+    if (request_opts.shard_count > 1) {
+        count = files != NULL ? select_shard(files, count) : request_opts.shard_index == 0;
+        if (count == 0) {
+            send(client_socket, "No file found", 13, 0);
+            return;
+        }
+    }
+    
+    if (estimate_only) {
+        send_estimate(client_socket, files, count, path);
+        return;
+    }
+    
+    // A job worker builds into the spool; the client fetches it later
+    if (job_archive != NULL) {
+        content_tag(files, count, path, job_tag);
+        job_status = create_tar_archive(job_archive, files, count, path);
+        return;
+    }
+    
+    // The client's cached copy is current: skip building entirely
+    content_tag(files, count, path, tag);
+    if (strcmp(tag, request_opts.if_none_match) == 0) {
+        char not_modified[64];
+        snprintf(not_modified, sizeof(not_modified), "Not modified %s", tag);
+        send(client_socket, not_modified, strlen(not_modified), 0);
+        return;
+    }
+    
+    // A fresh download is sent while the archive is still being written;
+    // deltas and descriptor passing need the finished file
+    int streaming = request_opts.stream && !request_opts.delta && !client_is_local;
+    pid_t builder = -1;
+    
+    int slot = join_build(archive_key(files, count, path), &leader);
+    
+    if (slot < 0) {
+        char tar_filename[64];
+        snprintf(tar_filename, sizeof(tar_filename), "%s.%d.tar.gz", ARCHIVE_PREFIX, (int)getpid());
+        if (streaming) {
+            builder = start_builder(tar_filename, files, count, path, -1);
+            if (stream_archive_file(client_socket, tar_filename, tag, -1, builder) != 0 && builder > 0) {
+                stop_builder(builder, -1);
+            }
+        } else if (create_tar_archive(tar_filename, files, count, path) == 0) {
+            send_archive_file(client_socket, tar_filename, tag);
+        } else {
+            send_build_error(client_socket);
+        }
+        unlink(tar_filename);
+        return;
+    }
+    
+    char *tar_filename = shared->builds[slot].tar_filename;
+    if (leader && streaming) {
+        builder = start_builder(tar_filename, files, count, path, slot);
+    } else if (leader) {
+        building_slot = slot;
+        int status = create_tar_archive(tar_filename, files, count, path);
+        building_slot = -1;
+        finish_build(slot, shared->builds[slot].key, getpid(), status);
+    } else {
+        log_event(LOG_DEBUG, "build_joined", "\"slot\":%d", slot);
+    }
+    
+    if (streaming) {
+        // Followers tail the same file, whichever way its leader builds it
+        int status = stream_archive_file(client_socket, tar_filename, tag, slot, builder);
+        if (builder > 0 && status != 0) {
+            stop_builder(builder, slot);
+        } else if (builder > 0) {
+            waitpid(builder, NULL, 0);
+        }
+    } else if (wait_for_build(slot) == BUILD_DONE) {
+        send_archive_file(client_socket, tar_filename, tag);
+    } else {
+        send_build_error(client_socket);
+    }
+    leave_build(slot);
+}
+
+// Split off the option lines after the command and parse the ones we know
+void parse_request_options(char *buffer) {
+    memset(&request_opts, 0, sizeof(request_opts));
+    
+    char *line = strchr(buffer, '\n');
+    if (line == NULL) {
+        prepare_request_filter();
+        return;
+    }
+    *line++ = '\0';
+    
+    while (line != NULL && *line != '\0') {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        
+        if (strncmp(line, "IF-NONE-MATCH ", 14) == 0) {
+            snprintf(request_opts.if_none_match, MAX_TAG, "%s", line + 14);
+        } else if (strncmp(line, "DELTA", 5) == 0) {
+            request_opts.delta = 1;
+        } else if (strncmp(line, "DEDUP", 5) == 0) {
+            request_opts.dedup = 1;
+        } else if (strncmp(line, "EXCLUDE ", 8) == 0) {
+            add_exclude(&request_opts.prune, line + 8);
+        } else if (strncmp(line, "MAXDEPTH ", 9) == 0) {
+            request_opts.prune.max_depth = atoi(line + 9);
+        } else if (strncmp(line, "NOHIDDEN", 8) == 0) {
+            request_opts.prune.skip_hidden = 1;
+        } else if (strncmp(line, "XDEV", 4) == 0) {
+            request_opts.prune.one_filesystem = 1;
+        } else if (strncmp(line, "DEADLINE ", 9) == 0) {
+            request_opts.deadline_ms = atol(line + 9);
+        } else if (strncmp(line, "STREAM", 6) == 0) {
+            request_opts.stream = 1;
+        } else if (strncmp(line, "ALL", 3) == 0) {
+            request_opts.find_all = 1;
+        } else if (strncmp(line, "LIMIT ", 6) == 0) {
+            request_opts.find_limit = atoi(line + 6);
+        } else if (strncmp(line, "SHARD ", 6) == 0) {
+            if (sscanf(line + 6, "%d/%d", &request_opts.shard_index, &request_opts.shard_count) != 2 ||
+                request_opts.shard_index < 0 || request_opts.shard_index >= request_opts.shard_count) {
+                request_opts.shard_count = 0;
+            }
+        }
+        line = next;
+    }
+    
+    prepare_request_filter();
+}
+
+// Tag over path, size and mtime of every member: it changes exactly when
+// the archive would. Members are stat()ed, since a file rewritten in place
+// leaves its directory, and so the index, unchanged until a full rescan,
+// and hashed in path order, so that every node tags a result alike.
+void content_tag(int *files, int count, char *path, char *tag) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    if (files != NULL) {
+        hash = hash_bytes(hash, &request_opts.dedup, sizeof(request_opts.dedup));
+        hash = hash_bytes(hash, &request_opts.open_ended, sizeof(request_opts.open_ended));
+        struct shard_member *members = malloc(sizeof(struct shard_member) * (count + 1));
+        if (members == NULL) {
+            // An unmatchable tag: the archive is sent in full
+            snprintf(tag, MAX_TAG, "%016lx", hash ^ (unsigned long)getpid());
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            index_entry_path(files[i], members[i].path);
+        }
+        qsort(members, count, sizeof(struct shard_member), compare_shard_members);
+        for (int i = 0; i < count; i++) {
+            hash = hash_member_stat(hash, members[i].path);
+        }
+        free(members);
+    } else {
+        hash = hash_member_stat(hash, path);
+    }
+    
+    snprintf(tag, MAX_TAG, "%016lx", hash);
+}
+
+unsigned long hash_member_stat(unsigned long hash, char *path) {
+    struct stat st = {0};
+    
+    stat(path, &st);
+    hash = hash_bytes(hash, path, strlen(path) + 1);
+    hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+    hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+    return hash_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+}
+
+void send_archive_file(int client_socket, char *tar_filename, char *tag) {
+    if (request_opts.delta) {
+        send_delta(client_socket, tar_filename, tag);
+    } else {
+        send_tar_file(client_socket, tar_filename, tag);
+    }
+}
+
+int recv_all(int socket, void *buffer, size_t len) {
+    char *p = buffer;
+    
+    while (len > 0) {
+        ssize_t n = recv(socket, p, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+unsigned int get_u32(unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+void put_u32(FILE *out, unsigned int value) {
+    unsigned char bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    fwrite(bytes, 1, 4, out);
+}
+
+int compare_signatures(const void *a, const void *b) {
+    unsigned int x = ((const struct block_signature *)a)->weak;
+    unsigned int y = ((const struct block_signature *)b)->weak;
+    return (x > y) - (x < y);
+}
+
+// Index of a client block equal to data, or -1; sigs are sorted by weak sum
+int find_block(struct block_signature *sigs, int count, unsigned int weak, unsigned char *data, int block_size) {
+    int lo = 0, hi = count;
+    
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sigs[mid].weak < weak) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    // Only blocks whose rolling sum matches pay for the strong hash
+    unsigned long strong = 0;
+    for (int i = lo; i < count && sigs[i].weak == weak; i++) {
+        if (strong == 0) {
+            strong = hash_bytes(1469598103934665603UL, data, block_size);
+        }
+        if (sigs[i].strong == strong) {
+            return sigs[i].index;
+        }
+    }
+    
+    return -1;
+}
+
+// rsync-style transfer: the client sends (weak, strong) signatures of the
+// blocks of its cached copy, we answer with copy-block and literal records.
+// Wire format, big-endian:
+//   client: u32 block count, u32 block size, then per block u32 weak, u32 strong hi, u32 strong lo
+//   server: 'C' u32 index | 'L' u32 len, bytes | 'E' u32 size hi, u32 size lo, u32 hash hi, u32 hash lo
+void send_delta(int client_socket, char *tar_filename, char *tag) {
+    int fd = open(tar_filename, O_RDONLY);
+    struct stat st;
+    
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        send(client_socket, "Error creating tar file", 23, 0);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    
+    char msg[64];
+    snprintf(msg, sizeof(msg), "DELTA %s", tag);
+    send(client_socket, msg, strlen(msg), 0);
+    
+    unsigned char header[8];
+    if (recv_all(client_socket, header, sizeof(header)) < 0) {
+        close(fd);
+        return;
+    }
+    unsigned int count = get_u32(header);
+    int block_size = get_u32(header + 4);
+    if (count > DELTA_MAX_BLOCKS || block_size <= 0 || block_size > DELTA_MAX_BLOCK) {
+        close(fd);
+        return;
+    }
+    
+    struct block_signature *sigs = malloc(sizeof(struct block_signature) * (count + 1));
+    unsigned char *raw = malloc(12 * (size_t)count + 1);
+    if (sigs == NULL || raw == NULL || recv_all(client_socket, raw, 12 * (size_t)count) < 0) {
+        free(sigs);
+        free(raw);
+        close(fd);
+        return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        sigs[i].weak = get_u32(raw + 12 * i);
+        sigs[i].strong = ((unsigned long)get_u32(raw + 12 * i + 4) << 32) | get_u32(raw + 12 * i + 8);
+        sigs[i].index = i;
+    }
+    free(raw);
+    qsort(sigs, count, sizeof(struct block_signature), compare_signatures);
+    
+    unsigned char *data = NULL;
+    long size = st.st_size;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            free(sigs);
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+    
+    FILE *out = fdopen(dup(client_socket), "wb");
+    if (out == NULL) {
+        if (data != NULL) munmap(data, size);
+        free(sigs);
+        return;
+    }
+    setvbuf(out, NULL, _IOFBF, DELTA_MAX_LITERAL);
+    begin_transfer();
+    
+    long pos = 0, literal_start = 0;
+    long copy_bytes = 0;  // copy records not yet charged to the pacer
+    unsigned int a = 0, b = 0;
+    int have_sum = 0;
+    
+    while (pos + block_size <= size) {
+        if (!have_sum) {
+            a = b = 0;
+            for (int i = 0; i < block_size; i++) {
+                a += data[pos + i];
+                b += (unsigned int)(block_size - i) * data[pos + i];
+            }
+            have_sum = 1;
+        }
+        
+        int index = count ? find_block(sigs, count, (a & 0xffff) | (b << 16), data + pos, block_size) : -1;
+        if (index >= 0) {
+            for (long lit = literal_start; lit < pos; lit += DELTA_MAX_LITERAL) {
+                long len = (pos - lit < DELTA_MAX_LITERAL) ? pos - lit : DELTA_MAX_LITERAL;
+                pace_transfer(len + 5);
+                fputc('L', out);
+                put_u32(out, len);
+                fwrite(data + lit, 1, len, out);
+            }
+            // Charged in batches so a long run of matches is paced
+            // without a pace_transfer call per record
+            copy_bytes += 5;
+            if (copy_bytes >= DELTA_MAX_LITERAL) {
+                pace_transfer(copy_bytes);
+                copy_bytes = 0;
+            }
+            fputc('C', out);
+            put_u32(out, index);
+            pos += block_size;
+            literal_start = pos;
+            have_sum = 0;
+            continue;
+        }
+        
+        // Roll the window one byte forward
+        if (pos + block_size < size) {
+            a = a - data[pos] + data[pos + block_size];
+            b = b - (unsigned int)block_size * data[pos] + a;
+        }
+        pos++;
+    }
+    
+    for (long lit = literal_start; lit < size; lit += DELTA_MAX_LITERAL) {
+        long len = (size - lit < DELTA_MAX_LITERAL) ? size - lit : DELTA_MAX_LITERAL;
+        pace_transfer(len + 5);
+        fputc('L', out);
+        put_u32(out, len);
+        fwrite(data + lit, 1, len, out);
+    }
+    
+    // Whole-file check lets the client reject a reconstruction on hash collision
+    unsigned long file_hash = hash_bytes(1469598103934665603UL, data, size);
+    pace_transfer(copy_bytes + 17);
+    fputc('E', out);
+    put_u32(out, (unsigned long)size >> 32);
+    put_u32(out, size);
+    put_u32(out, file_hash >> 32);
+    put_u32(out, file_hash);
+    fclose(out);
+    end_transfer();
+    
+    if (data != NULL) munmap(data, size);
+    free(sigs);
+}
+// Server-wide pruning: FS_EXCLUDE (comma-separated globs), FS_MAX_DEPTH,
+// FS_SKIP_HIDDEN, FS_ONE_FILESYSTEM and FS_IGNORE_FILE (e.g. .gitignore)
+void load_prune_rules() {
+    char *excludes = getenv("FS_EXCLUDE");
+    
+    if (excludes != NULL) {
+        char list[MAX_EXCLUDES * MAX_PATTERN];
+        snprintf(list, sizeof(list), "%s", excludes);
+        for (char *pattern = strtok(list, ","); pattern != NULL; pattern = strtok(NULL, ",")) {
+            add_exclude(&server_rules, pattern);
+        }
+    }
+    server_rules.max_depth = config_int("FS_MAX_DEPTH", 0);
+    server_rules.skip_hidden = config_int("FS_SKIP_HIDDEN", 0);
+    server_rules.one_filesystem = config_int("FS_ONE_FILESYSTEM", 0);
+    
+    char *ignore_name = getenv("FS_IGNORE_FILE");
+    snprintf(ignore_file_name, sizeof(ignore_file_name), "%s", ignore_name ? ignore_name : "");
+}
+
+int add_exclude(struct prune_rules *rules, char *pattern) {
+    if (*pattern == '\0' || rules->exclude_count == MAX_EXCLUDES) {
+        return -1;
+    }
+    
+    snprintf(rules->excludes[rules->exclude_count++], MAX_PATTERN, "%s", pattern);
+    return 0;
+}
+
+// Name-only checks, made before the entry is even stat()ed
+int prune_name(struct prune_rules *rules, char *name) {
+    if (rules->skip_hidden && name[0] == '.') {
+        return 1;
+    }
+    
+    for (int i = 0; i < rules->exclude_count; i++) {
+        if (fnmatch(rules->excludes[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Should the walk stay out of a directory at this depth on this device?
+int prune_dir(struct prune_rules *rules, int depth, dev_t dev) {
+    if (rules->max_depth > 0 && depth >= rules->max_depth) {
+        return 1;
+    }
+    
+    return rules->one_filesystem && dev != home_dev;
+}
+
+// Read dir_path's ignore file into node; returns the chain now in effect
+struct ignore_file *load_ignore_file(char *dir_path, struct ignore_file *node, struct ignore_file *parent) {
+    char path[MAX_PATH];
+    
+    if (ignore_file_name[0] == '\0') {
+        return parent;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", dir_path, ignore_file_name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return parent;
+    }
+    
+    struct stat ignore_stat;
+    node->mtime = fstat(fd, &ignore_stat) == 0 ? ignore_stat.st_mtime : 0;
+    node->text = malloc(MAX_IGNORE_FILE_SIZE + 1);
+    ssize_t len = node->text ? read(fd, node->text, MAX_IGNORE_FILE_SIZE) : -1;
+    close(fd);
+    if (len <= 0) {
+        free(node->text);
+        return parent;
+    }
+    node->text[len] = '\0';
+    node->parent = parent;
+    node->base = dir_path;
+    node->count = 0;
+    
+    // One glob per line; blank lines, comments and negations are skipped
+    for (char *line = strtok(node->text, "\r\n"); line != NULL && node->count < MAX_IGNORE_PATTERNS;
+         line = strtok(NULL, "\r\n")) {
+        if (*line == '\0' || *line == '#' || *line == '!') continue;
+        
+        int end = strlen(line) - 1;
+        node->dir_only[node->count] = line[end] == '/';
+        if (node->dir_only[node->count]) line[end] = '\0';
+        if (*line != '\0') {
+            node->patterns[node->count++] = line;
+        }
+    }
+    
+    return node;
+}
+
+// Patterns with a '/' match the path below the ignore file's directory,
+// others match the entry name at any depth
+int is_ignored(struct ignore_file *ignores, char *full_path, char *name, int is_dir) {
+    for (struct ignore_file *f = ignores; f != NULL; f = f->parent) {
+        char *relative = full_path + strlen(f->base) + 1;
+        
+        for (int i = 0; i < f->count; i++) {
+            char *pattern = f->patterns[i];
+            if (f->dir_only[i] && !is_dir) continue;
+            
+            if (strchr(pattern, '/') != NULL) {
+                if (*pattern == '/') pattern++;
+                if (fnmatch(pattern, relative, FNM_PATHNAME) == 0) return 1;
+            } else if (fnmatch(pattern, name, 0) == 0) {
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// The index is built with server rules only; a request's own rules are
+// applied to its results by marking excluded directories once per request
+void prepare_request_filter() {
+    struct prune_rules *rules = &request_opts.prune;
+    
+    free(request_dir_pruned);
+    request_dir_pruned = NULL;
+    if (rules->exclude_count == 0 && rules->max_depth == 0 &&
+        !rules->skip_hidden && !rules->one_filesystem) {
+        return;
+    }
+    
+    request_dir_pruned = malloc(file_index.dir_count + 1);
+    if (request_dir_pruned == NULL) {
+        return;
+    }
+    
+    // A directory is always interned after its parent
+    for (int d = 0; d < file_index.dir_count; d++) {
+        struct dir_node *n = &file_index.dirs[d];
+        request_dir_pruned[d] = n->parent >= 0 &&
+            (request_dir_pruned[n->parent] || prune_name(rules, n->name) ||
+             prune_dir(rules, n->depth, n->dev));
+    }
+}
+
+int entry_visible(int id) {
+    struct file_entry *e = &file_index.entries[id];
+    
+    if (request_dir_pruned == NULL) {
+        return 1;
+    }
+    
+    return !request_dir_pruned[e->dir] && !prune_name(&request_opts.prune, e->name);
+}
+
+// Empty the set and mark the walk's root as visited
+void begin_walk(struct visited_set *set, char *root_path) {
+    struct stat root_stat;
+    
+    if (set->slots != NULL) {
+        memset(set->slots, 0, sizeof(struct visited_dir) * set->capacity);
+    }
+    set->used = 0;
+    
+    if (stat(root_path, &root_stat) == 0) {
+        first_visit(set, &root_stat);
+    }
+}
+
+// Record the directory; returns 0 if this walk already entered it
+int first_visit(struct visited_set *set, struct stat *dir_stat) {
+    // Keep the load factor under 1/2; rehash into a table twice the size
+    if ((set->used + 1) * 2 > set->capacity) {
+        struct visited_set grown;
+        grown.capacity = set->capacity ? set->capacity * 2 : VISITED_INITIAL_SLOTS;
+        grown.used = 0;
+        grown.slots = calloc(grown.capacity, sizeof(struct visited_dir));
+        if (grown.slots == NULL) {
+            perror("visited calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < set->capacity; i++) {
+            if (set->slots[i].dev != 0 || set->slots[i].ino != 0) {
+                struct stat old = {0};
+                old.st_dev = set->slots[i].dev;
+                old.st_ino = set->slots[i].ino;
+                first_visit(&grown, &old);
+            }
+        }
+        free(set->slots);
+        *set = grown;
+    }
+    
+    unsigned long hash = ((unsigned long)dir_stat->st_ino * 0x9E3779B97F4A7C15UL) ^ (unsigned long)dir_stat->st_dev;
+    int i = (hash ^ (hash >> 29)) & (set->capacity - 1);
+    
+    while (set->slots[i].dev != 0 || set->slots[i].ino != 0) {
+        if (set->slots[i].dev == dir_stat->st_dev && set->slots[i].ino == dir_stat->st_ino) {
+            return 0;
+        }
+        i = (i + 1) & (set->capacity - 1);
+    }
+    
+    set->slots[i].dev = dir_stat->st_dev;
+    set->slots[i].ino = dir_stat->st_ino;
+    set->used++;
+    return 1;
+}
+
+// A single file is archived as its own gzip member followed by the
+// constant end-of-archive member, so the first part can be cached and
+// later copied into new archives without running gzip
+int create_single_archive(char *tar_filename, char *path) {
+    struct archive_member m;
+    int status = 0;
+    pid_t gzip_pid;
+    
+    int out_fd = open(tar_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("open archive");
+        return -1;
+    }
+    if (write_cached_member(out_fd, path) == 0) {
+        char path_json[LOG_LINE_MAX];
+        log_event(LOG_DEBUG, "member_cache_hit", "\"path\":%s", json_str(path_json, sizeof(path_json), path));
+    } else {
+        close(out_fd);
+        
+        out_fd = start_gzip(tar_filename, &gzip_pid);
+        if (out_fd < 0) {
+            return -1;
+        }
+        snprintf(m.path, sizeof(m.path), "%s", path);
+        open_archive_member(&m);
+        if (m.fd >= 0) {
+            status = write_archive_member(out_fd, &m);
+            close(m.fd);
+        } else {
+            status = -1;  // became unreadable since it was looked up
+        }
+        close(out_fd);
+        
+        int gzip_status;
+        if (waitpid(gzip_pid, &gzip_status, 0) < 0 || !WIFEXITED(gzip_status) || WEXITSTATUS(gzip_status) != 0) {
+            status = -1;
+        }
+        if (status == 0 && m.fd >= 0) {
+            store_cached_member(path, &m.st, tar_filename);
+            learn_compression(m.st.st_size, GZIP_STREAM_OVERHEAD + member_overhead(path), tar_filename);
+        }
+        
+        out_fd = open(tar_filename, O_WRONLY | O_APPEND);
+        if (out_fd < 0) {
+            status = -1;
+        }
+    }
+    
+    if (status == 0 && write_all(out_fd, (char *)gzip_tar_trailer, sizeof(gzip_tar_trailer)) < 0) {
+        status = -1;
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    
+    if (status < 0) {
+        unlink(tar_filename);
+    }
+    return status;
+}
+
+void init_member_cache() {
+    long capacity = (long)config_int("FS_MEMBER_CACHE_KB", MEMBER_CACHE_KB) * 1024;
+    if (capacity <= 0) {
+        return;
+    }
+    
+    // A reload keeps the cache warm unless FS_MEMBER_CACHE_KB changed
+    int reused;
+    member_cache = map_shared("FS_MEMBER_CACHE_FD", sizeof(struct member_cache) + capacity,
+                              &member_cache_fd, &reused);
+    if (member_cache == MAP_FAILED) {
+        perror("mmap member cache");
+        member_cache = NULL;
+        return;
+    }
+    if (reused) {
+        return;
+    }
+    memset(member_cache, 0, sizeof(struct member_cache));
+    member_cache->capacity = capacity;
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&member_cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Pruning options change which file a name resolves to
+unsigned long member_name_key(char *filename) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    hash = hash_bytes(hash, filename, strlen(filename) + 1);
+    hash = hash_bytes(hash, &request_opts.prune, sizeof(request_opts.prune));
+    return hash ? hash : 1;
+}
+
+// Path a name resolved to earlier in this index generation, if still a file
+int lookup_cached_path(unsigned long name_key, char *path) {
+    struct stat st;
+    int found = 0;
+    
+    if (member_cache == NULL) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&member_cache->lock);
+    for (int i = 0; i < MEMBER_CACHE_SLOTS; i++) {
+        struct cached_member *c = &member_cache->slots[i];
+        if (c->path[0] != '\0' && c->name_key == name_key && c->generation == file_index.generation) {
+            snprintf(path, MAX_PATH, "%s", c->path);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&member_cache->lock);
+    
+    if (found && (stat(path, &st) < 0 || !S_ISREG(st.st_mode))) {
+        path[0] = '\0';
+        found = 0;
+    }
+    return found;
+}
+
+void remember_cached_path(unsigned long name_key, char *path) {
+    if (member_cache == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&member_cache->lock);
+    for (int i = 0; i < MEMBER_CACHE_SLOTS; i++) {
+        struct cached_member *c = &member_cache->slots[i];
+        if (strcmp(c->path, path) == 0) {
+            c->name_key = name_key;
+            c->generation = file_index.generation;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&member_cache->lock);
+}
+
+// Slot holding path's member; the caller holds the lock
+int find_cached_member(char *path, struct stat *st) {
+    for (int i = 0; i < MEMBER_CACHE_SLOTS; i++) {
+        struct cached_member *c = &member_cache->slots[i];
+        if (c->path[0] != '\0' && strcmp(c->path, path) == 0) {
+            if (st != NULL && (c->dev != st->st_dev || c->ino != st->st_ino ||
+                               c->size != st->st_size || c->mtime != st->st_mtime)) {
+                return -1;
+            }
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+// Copy path's member into out_fd; -1 when it is not cached or is stale
+int write_cached_member(int out_fd, char *path) {
+    struct stat st;
+    char *copy = NULL;
+    long length = 0;
+    
+    if (member_cache == NULL || stat(path, &st) < 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&member_cache->lock);
+    int slot = find_cached_member(path, &st);
+    if (slot >= 0) {
+        struct cached_member *c = &member_cache->slots[slot];
+        copy = malloc(c->length);
+        if (copy != NULL) {
+            memcpy(copy, member_cache->data + c->offset, c->length);
+            length = c->length;
+            c->last_used = ++member_cache->clock;
+        }
+    }
+    pthread_mutex_unlock(&member_cache->lock);
+    
+    if (copy == NULL) {
+        return -1;
+    }
+    int status = write_all(out_fd, copy, length);
+    free(copy);
+    return status;
+}
+
+// Keep the freshly compressed member in tar_filename for later archives
+void store_cached_member(char *path, struct stat *st, char *tar_filename) {
+    if (member_cache == NULL) {
+        return;
+    }
+    
+    int fd = open(tar_filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat member_stat;
+    long length = fstat(fd, &member_stat) == 0 ? member_stat.st_size : -1;
+    if (length <= 0 || length > MEMBER_CACHE_MAX_MEMBER || length > member_cache->capacity / 4) {
+        close(fd);
+        return;
+    }
+    char *member = malloc(length);
+    if (member == NULL || read(fd, member, length) != length) {
+        free(member);
+        close(fd);
+        return;
+    }
+    close(fd);
+    
+    pthread_mutex_lock(&member_cache->lock);
+    
+    // Replace any older version of this file
+    int slot = find_cached_member(path, NULL);
+    if (slot >= 0) {
+        member_cache->slots[slot].path[0] = '\0';
+    }
+    
+    // Take the next range of the ring, evicting members that overlap it
+    if (member_cache->tail + length > member_cache->capacity) {
+        member_cache->tail = 0;
+    }
+    long offset = member_cache->tail;
+    member_cache->tail += length;
+    
+    for (int i = 0; i < MEMBER_CACHE_SLOTS; i++) {
+        struct cached_member *c = &member_cache->slots[i];
+        if (c->path[0] != '\0' && c->offset < offset + length && offset < c->offset + c->length) {
+            c->path[0] = '\0';
+        }
+    }
+    
+    // A free slot, else the least recently used one
+    int victim = 0;
+    for (int i = 0; i < MEMBER_CACHE_SLOTS && member_cache->slots[victim].path[0] != '\0'; i++) {
+        if (member_cache->slots[i].path[0] == '\0' ||
+            member_cache->slots[i].last_used < member_cache->slots[victim].last_used) {
+            victim = i;
+        }
+    }
+    
+    struct cached_member *c = &member_cache->slots[victim];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->size = st->st_size;
+    c->mtime = st->st_mtime;
+    c->offset = offset;
+    c->length = length;
+    c->last_used = ++member_cache->clock;
+    memcpy(member_cache->data + offset, member, length);
+    
+    pthread_mutex_unlock(&member_cache->lock);
+    free(member);
+}
+
+long monotonic_ms() {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void begin_request(int client_socket) {
+    request_socket = client_socket;
+    cancel_reason = 0;
+    query_truncated = 0;
+    request_deadline = request_opts.deadline_ms > 0 ? monotonic_ms() + request_opts.deadline_ms : 0;
+    request_started_ms = monotonic_ms();
+    request_bytes = 0;
+}
+
+// Cancellation checkpoint for long-running work: has the deadline passed,
+// or has the client closed its end? A peek never consumes the next command.
+int request_cancelled() {
+    char probe;
+    
+    if (cancel_reason) {
+        return cancel_reason;
+    }
+    
+    if (request_deadline > 0 && monotonic_ms() >= request_deadline) {
+        cancel_reason = CANCEL_DEADLINE;
+    } else if (request_socket >= 0) {
+        ssize_t n = recv(request_socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            cancel_reason = CANCEL_DISCONNECT;
+        }
+    } else if (job_cancel_path[0] && access(job_cancel_path, F_OK) == 0) {
+        cancel_reason = CANCEL_JOB;
+    }
+    
+    if (cancel_reason) {
+        log_event(LOG_WARN, "cancelled", "\"reason\":\"%s\"", cancel_reason == CANCEL_DEADLINE ? "deadline exceeded" :
+                  cancel_reason == CANCEL_JOB ? "job cancelled" : "client disconnected");
+    }
+    return cancel_reason;
+}
+
+// A coalesced build keeps going while other requests still wait for it
+int build_cancelled() {
+    if (building_slot >= 0 && __atomic_load_n(&shared->builds[building_slot].refs, __ATOMIC_ACQUIRE) > 1) {
+        return 0;
+    }
+    
+    if (stop_requested && !cancel_reason) {
+        cancel_reason = CANCEL_DISCONNECT;
+    }
+    return request_cancelled();
+}
+
+// Only a client that is still there hears about its deadline
+void send_cancelled(int client_socket) {
+    if (cancel_reason == CANCEL_DEADLINE) {
+        send(client_socket, "Error: deadline exceeded", 24, 0);
+    }
+}
+
+void send_build_error(int client_socket) {
+    if (cancel_reason) {
+        send_cancelled(client_socket);
+    } else {
+        send(client_socket, "Error creating tar file", 23, 0);
+    }
+}
+
+// Build in a child so the request process can send the file as it grows
+pid_t start_builder(char *tar_filename, int *files, int count, char *path, int slot) {
+    // Exists before the first read, even if the builder is slow to start
+    int fd = open(tar_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    // The slot is handed from us to the builder under the lock, before
+    // either can finish it
+    unsigned long key = slot >= 0 ? shared->builds[slot].key : 0;
+    if (slot >= 0) {
+        pthread_mutex_lock(&shared->lock);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        building_slot = slot;
+        signal(SIGTERM, request_builder_stop);
+        int status = create_tar_archive(tar_filename, files, count, path);
+        if (slot >= 0) {
+            finish_build(slot, key, getpid(), status);
+        }
+        fflush(stdout);
+        _exit(status == 0 ? 0 : 1);
+    }
+    
+    if (slot >= 0) {
+        if (pid > 0) {
+            shared->builds[slot].builder = pid;
+        }
+        pthread_mutex_unlock(&shared->lock);
+    }
+    if (pid < 0) {
+        perror("fork builder");
+        if (slot >= 0) {
+            finish_build(slot, key, getpid(), -1);
+        }
+    }
+    return pid;
+}
+
+// The builder may hold shared->lock or the member cache lock when this
+// arrives, so it only notes the stop; build_cancelled acts on it between
+// members, outside those critical sections
+void request_builder_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// A streaming request gave up: stop its builder unless other requests
+// still read the archive, and reap it before leave_build can free the
+// slot for another build
+void stop_builder(pid_t builder, int slot) {
+    if (slot < 0 || __atomic_load_n(&shared->builds[slot].refs, __ATOMIC_ACQUIRE) <= 1) {
+        kill(builder, SIGTERM);
+    }
+    waitpid(builder, NULL, 0);
+}
+
+// Has the archive stopped growing? Sets status to 0 if it is complete.
+int build_finished(int slot, pid_t builder, int *status) {
+    if (slot >= 0) {
+        struct inflight_build *b = &shared->builds[slot];
+        int state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+        if (state == BUILD_RUNNING) {
+            pid_t dead = b->builder;
+            if (kill(dead, 0) < 0 && errno == ESRCH) {
+                finish_build(slot, b->key, dead, -1);
+                *status = -1;
+                return 1;
+            }
+            return 0;
+        }
+        *status = (state == BUILD_DONE) ? 0 : -1;
+        return 1;
+    }
+    
+    int builder_status;
+    if (builder < 0) {
+        *status = -1;
+        return 1;
+    }
+    if (waitpid(builder, &builder_status, WNOHANG) == 0) {
+        return 0;
+    }
+    *status = (WIFEXITED(builder_status) && WEXITSTATUS(builder_status) == 0) ? 0 : -1;
+    return 1;
+}
+
+// Send tar_filename while it is still being written: "STREAM <tag>", then
+// after the ACK chunks of <u32 length><bytes>, ended by a zero length
+// (complete) or STREAM_ABORT (the build failed or was cancelled)
+int stream_archive_file(int client_socket, char *tar_filename, char *tag, int slot, pid_t builder) {
+    char header[64];
+    char ack[10];
+    int fd = -1, status = 0, finished = 0;
+    long total = 0;
+    
+    snprintf(header, sizeof(header), "STREAM %s", tag);
+    send(client_socket, header, strlen(header), 0);
+    recv(client_socket, ack, sizeof(ack), 0);
+    
+    unsigned char *buffer = malloc(STREAM_CHUNK + 4);
+    if (buffer == NULL) {
+        return -1;
+    }
+    
+    begin_transfer();
+    while (1) {
+        if (fd < 0) {
+            fd = open(tar_filename, O_RDONLY);
+        }
+        ssize_t n = fd >= 0 ? read(fd, buffer + 4, STREAM_CHUNK) : 0;
+        if (n > 0) {
+            buffer[0] = n >> 24;
+            buffer[1] = n >> 16;
+            buffer[2] = n >> 8;
+            buffer[3] = n;
+            pace_transfer(n + 4);
+            if (write_all(client_socket, (char *)buffer, n + 4) < 0) {
+                status = -1;
+                break;
+            }
+            total += n;
+            continue;
+        }
+        
+        // At the current end of the file: done once the builder is and
+        // everything it wrote has been read, otherwise wait for more
+        if (finished) {
+            break;
+        }
+        finished = build_finished(slot, builder, &status);
+        if (!finished) {
+            if (request_cancelled()) {
+                status = -1;
+                break;
+            }
+            usleep(STREAM_POLL_US);
+        }
+    }
+    end_transfer();
+    if (fd < 0) {
+        status = -1;
+    }
+    
+    unsigned int end = (status == 0) ? 0 : STREAM_ABORT;
+    buffer[0] = end >> 24;
+    buffer[1] = end >> 16;
+    buffer[2] = end >> 8;
+    buffer[3] = end;
+    write_all(client_socket, (char *)buffer, 4);
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    log_event(LOG_DEBUG, "streamed", "\"bytes\":%ld,\"aborted\":%s", total, status == 0 ? "false" : "true");
+    return status;
+}
+
+// Append a directory to the search queue, taking ownership of path
+int push_search_dir(struct search_queue *queue, char *path, int depth, struct ignore_file *ignores) {
+    if (path == NULL) {
+        return -1;
+    }
+    
+    if (queue->tail == queue->capacity) {
+        // Reuse the space of directories already searched before growing
+        if (queue->head > 0) {
+            memmove(queue->entries, queue->entries + queue->head,
+                    (queue->tail - queue->head) * sizeof(struct search_dir));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->tail == queue->capacity) {
+            int capacity = queue->capacity ? queue->capacity * 2 : 256;
+            struct search_dir *entries = realloc(queue->entries, capacity * sizeof(struct search_dir));
+            if (entries == NULL) {
+                free(path);
+                return -1;
+            }
+            queue->entries = entries;
+            queue->capacity = capacity;
+        }
+    }
+    
+    queue->entries[queue->tail].path = path;
+    queue->entries[queue->tail].depth = depth;
+    queue->entries[queue->tail].ignores = ignores;
+    queue->tail++;
+    return 0;
+}
+
+// FNV-1a finished with a 64-bit mix, so both halves are usable as hashes
+unsigned long name_filter_hash(char *name) {
+    unsigned long hash = 1469598103934665603UL;
+    
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211UL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    
+    return hash;
+}
+
+// Bloom filter over every indexed basename, about 1% false positives.
+// Rebuilt with the index; hashing the names is cheap next to the walk,
+// and directories copied from the previous index cost nothing extra.
+void build_name_filter() {
+    unsigned long bits = 64;
+    
+    while (bits < (unsigned long)next_index.count * NAME_FILTER_BITS_PER_NAME) {
+        bits <<= 1;
+    }
+    next_index.name_filter = calloc(bits / 64, sizeof(unsigned long));
+    if (next_index.name_filter == NULL) {
+        return;  // lookups fall back to walking
+    }
+    next_index.filter_mask = bits - 1;
+    
+    for (int i = 0; i < next_index.count; i++) {
+        unsigned long hash = name_filter_hash(next_index.entries[i].name);
+        unsigned long step = (hash >> 32) | 1;
+        for (int k = 0; k < NAME_FILTER_HASHES; k++) {
+            unsigned long bit = (hash + k * step) & next_index.filter_mask;
+            next_index.name_filter[bit / 64] |= 1UL << (bit % 64);
+        }
+    }
+}
+
+// Can a file called name exist? The index is what the walk would see
+// (same pruning rules and ignore files), but only as of its build, so a
+// miss is trusted only while no indexed directory has changed since.
+int check_name_filter(char *name) {
+    if (!name_filter_enabled || file_index.name_filter == NULL) {
+        return FILTER_SKIPPED;
+    }
+    
+    __atomic_fetch_add(&shared->filter_lookups, 1, __ATOMIC_RELAXED);
+    unsigned long hash = name_filter_hash(name);
+    unsigned long step = (hash >> 32) | 1;
+    for (int k = 0; k < NAME_FILTER_HASHES; k++) {
+        unsigned long bit = (hash + k * step) & file_index.filter_mask;
+        if (!(file_index.name_filter[bit / 64] & (1UL << (bit % 64)))) {
+            if (!index_dirs_unchanged()) {
+                return FILTER_SKIPPED;
+            }
+            __atomic_fetch_add(&shared->filter_absent, 1, __ATOMIC_RELAXED);
+            return FILTER_ABSENT;
+        }
+    }
+    
+    return FILTER_MAYBE;
+}
+
+// Creating, renaming or deleting a file moves its directory's mtime, so
+// if every indexed directory (and ignore file) is as the build saw it,
+// the filter still covers every name a walk could find. One stat per
+// directory instead of a readdir and a stat per entry.
+int index_dirs_unchanged() {
+    char path[MAX_PATH];
+    struct stat st;
+    
+    for (int d = 0; d < file_index.dir_count; d++) {
+        struct dir_node *n = &file_index.dirs[d];
+        int len = index_dir_path(d, path, sizeof(path));
+        // Within the build's second the mtime may not have moved yet
+        if (len >= (int)sizeof(path) || stat(path, &st) < 0 || st.st_mtime != n->mtime ||
+            st.st_ctime != n->ctime || n->mtime >= file_index.built_at) {
+            return 0;
+        }
+        if (n->ignore_mtime != 0) {
+            snprintf(path + len, sizeof(path) - len, "/%s", ignore_file_name);
+            if (stat(path, &st) < 0 || st.st_mtime != n->ignore_mtime) {
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+// Walk $HOME for filename unless the filter rules it out
+int search_home(char *filename, int limit, int stream_socket, char *result_path) {
+    char home_path[MAX_PATH];
+    
+    int verdict = check_name_filter(filename);
+    if (verdict == FILTER_ABSENT) {
+        return 0;
+    }
+    
+    snprintf(home_path, sizeof(home_path), "%s", getenv("HOME"));
+    begin_walk(&search_visited, home_path);
+    int matches = search_directory(home_path, filename, limit, stream_socket, result_path);
+    
+    if (verdict == FILTER_MAYBE && matches == 0 && !cancel_reason) {
+        __atomic_fetch_add(&shared->filter_false_positives, 1, __ATOMIC_RELAXED);
+    }
+    return matches;
+}
+
+void send_stats(int client_socket) {
+    char stats[512];
+    long lookups = __atomic_load_n(&shared->filter_lookups, __ATOMIC_RELAXED);
+    long absent = __atomic_load_n(&shared->filter_absent, __ATOMIC_RELAXED);
+    long false_positives = __atomic_load_n(&shared->filter_false_positives, __ATOMIC_RELAXED);
+    
+    // Share of names not on disk that the filter failed to rule out
+    double rate = absent + false_positives > 0 ? 100.0 * false_positives / (absent + false_positives) : 0;
+    
+    snprintf(stats, sizeof(stats),
+             "Index: %d files in %d directories, built %lds ago. "
+             "Name filter: %lu bits, %ld lookups, %ld answered without a walk, "
+             "%ld false positives (%.2f%% of missing names)",
+             file_index.count, file_index.dir_count, (long)(time(NULL) - file_index.built_at),
+             file_index.name_filter ? file_index.filter_mask + 1 : 0,
+             lookups, absent, false_positives, rate);
+    send(client_socket, stats, strlen(stats), 0);
+}
+
+// Members are stored relative to /, as tar does
+char *tar_member_name(char *path) {
+    while (*path == '/') path++;
+    return path;
+}
+
+// Compressed bytes one member adds besides its data. The header and the
+// zero padding shrink to a few bytes; a GNU long name only to about half.
+long member_overhead(char *path) {
+    long name_len = strlen(tar_member_name(path));
+    
+    return GZIP_MEMBER_OVERHEAD + (name_len >= 100 ? name_len / 2 : 0);
+}
+
+// Fold a finished build into the shared compression ratio of file data:
+// the archive size minus the estimated overhead of its members, over
+// the data bytes. The totals are halved when they grow large, so recent
+// archives weigh the most.
+void learn_compression(long input, long overhead, char *tar_filename) {
+    struct stat st;
+    
+    if (input <= 0 || stat(tar_filename, &st) < 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&shared->ratio_lock);
+    shared->ratio_input += input;
+    shared->ratio_output += st.st_size > overhead ? st.st_size - overhead : 0;
+    while (shared->ratio_input > RATIO_WINDOW) {
+        shared->ratio_input /= 2;
+        shared->ratio_output /= 2;
+    }
+    pthread_mutex_unlock(&shared->ratio_lock);
+}
+
+// "ESTIMATE <files> <bytes> <archive bytes> [truncated]": what the command
+// would send, without reading a file. Sizes come from the index; the
+// data is compressed at the learned ratio, or not at all before the first
+// build, and each member adds its overhead.
+void send_estimate(int client_socket, int *files, int count, char *path) {
+    char reply[128];
+    char entry_path[MAX_PATH];
+    long bytes = 0, overhead = GZIP_STREAM_OVERHEAD;
+    
+    if (files == NULL) {
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            bytes = st.st_size;
+        }
+        overhead += member_overhead(path);
+    } else {
+        for (int i = 0; i < count; i++) {
+            index_entry_path(files[i], entry_path);
+            bytes += file_index.entries[files[i]].size;
+            overhead += member_overhead(entry_path);
+        }
+    }
+    
+    pthread_mutex_lock(&shared->ratio_lock);
+    double ratio = shared->ratio_input > 0 ? (double)shared->ratio_output / shared->ratio_input : 1.0;
+    pthread_mutex_unlock(&shared->ratio_lock);
+    
+    snprintf(reply, sizeof(reply), "ESTIMATE %d %ld %ld%s", count, bytes, overhead + (long)(bytes * ratio),
+             query_truncated ? " truncated" : "");
+    send(client_socket, reply, strlen(reply), 0);
+}
+
+// The four archive commands, shared by connections and job workers
+void run_archive_command(int client_socket, char *buffer) {
+    if (strncmp(buffer, "sgetfiles", 9) == 0) {
+        long size1, size2;
+        if (sscanf(buffer, "sgetfiles %ld %ld", &size1, &size2) == 2) {
+            if (size1 <= size2) {
+                get_files_by_size(client_socket, size1, size2);
+            } else {
+                send(client_socket, "Invalid size range", 18, 0);
+            }
+        } else {
+            send(client_socket, "Invalid sgetfiles syntax", 24, 0);
+        }
+    }
+    else if (strncmp(buffer, "dgetfiles", 9) == 0) {
+        char date1[32], date2[32];
+        if (sscanf(buffer, "dgetfiles %s %s", date1, date2) == 2) {
+            if (is_valid_date(date1) && is_valid_date(date2)) {
+                get_files_by_date(client_socket, date1, date2);
+            } else {
+                send(client_socket, "Invalid date format", 19, 0);
+            }
+        } else {
+            send(client_socket, "Invalid dgetfiles syntax", 24, 0);
+        }
+    }
+    else if (strncmp(buffer, "getfiles", 8) == 0) {
+        char extensions[6][16];
+        int ext_count = 0;
+        char *token = strtok(buffer + 9, " ");
+        
+        while (token != NULL && ext_count < 6) {
+            strcpy(extensions[ext_count], token);
+            ext_count++;
+            token = strtok(NULL, " ");
+        }
+        
+        if (ext_count >= 1 && ext_count <= 6) {
+            char *ext_ptrs[6];
+            for (int i = 0; i < ext_count; i++) {
+                ext_ptrs[i] = extensions[i];
+            }
+            get_files_by_extension(client_socket, ext_ptrs, ext_count);
+        } else {
+            send(client_socket, "Invalid getfiles syntax", 23, 0);
+        }
+    }
+    else if (strncmp(buffer, "getftar", 7) == 0) {
+        char filename[256];
+        if (sscanf(buffer, "getftar %s", filename) == 1) {
+            get_file_tar(client_socket, filename);
+        } else {
+            send(client_socket, "Invalid getftar syntax", 22, 0);
+        }
+    }
+}
+
+void init_job_spool() {
+    char *dir = getenv("FS_SPOOL_DIR");
+    if (dir != NULL && *dir) {
+        snprintf(spool_dir, sizeof(spool_dir), "%s", dir);
+    }
+    max_job_workers = config_int("FS_JOB_WORKERS", max_job_workers);
+    if (max_job_workers > MAX_JOB_WORKERS) {
+        max_job_workers = MAX_JOB_WORKERS;
+    }
+    job_ttl = config_int("FS_JOB_TTL", JOB_TTL);
+    
+    if (mkdir(spool_dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir spool");
+    }
+}
+
+// Ids are hex, so they can't name anything outside the spool
+int valid_job_id(char *id) {
+    int len = strlen(id);
+    
+    if (len == 0 || len > MAX_JOB_ID) {
+        return 0;
+    }
+    for (int i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)id[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void job_path(char *id, char *suffix, char *path) {
+    snprintf(path, MAX_PATH, "%s/%.*s%s", spool_dir, MAX_JOB_ID, id, suffix);
+}
+
+// Which state file exists, checked in the order jobs move through them.
+// detail gets that file's text: the content tag of a done job, the reason
+// a job failed. Returns NULL for an unknown (or expired) job.
+char *job_state(char *id, char *detail, size_t size) {
+    char *states[] = {"queued", "running", "done", "failed", "cancelled"};
+    char path[MAX_PATH], suffix[16];
+    
+    for (int i = 0; i < 5; i++) {
+        snprintf(suffix, sizeof(suffix), ".%s", states[i]);
+        job_path(id, suffix, path);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t n = read(fd, detail, size - 1);
+        close(fd);
+        detail[n > 0 ? n : 0] = '\0';
+        
+        // A worker that died (on either server) leaves its job running
+        if (strcmp(states[i], "running") == 0) {
+            char pid_text[32] = "";
+            job_path(id, ".pid", path);
+            fd = open(path, O_RDONLY);
+            if (fd >= 0) {
+                n = read(fd, pid_text, sizeof(pid_text) - 1);
+                close(fd);
+                pid_text[n > 0 ? n : 0] = '\0';
+                pid_t pid = atoi(pid_text);
+                if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+                    finish_job(id, "failed", "worker exited");
+                    snprintf(detail, size, "worker exited");
+                    return "failed";
+                }
+            }
+        }
+        return states[i];
+    }
+    
+    return NULL;
+}
+
+// "submit <archive command>": queue it and answer with the job id at once
+void submit_job(int client_socket, char *request) {
+    char id[MAX_JOB_ID + 1];
+    char path[MAX_PATH], queued[MAX_PATH];
+    unsigned char random[8];
+    char reply[64];
+    
+    if (command_class(request) != CLASS_ARCHIVE) {
+        send(client_socket, "Invalid submit syntax", 21, 0);
+        return;
+    }
+    
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, random, sizeof(random)) != sizeof(random)) {
+        unsigned long fallback = monotonic_ms() ^ ((unsigned long)getpid() << 32);
+        memcpy(random, &fallback, sizeof(random));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (int i = 0; i < 8; i++) {
+        snprintf(id + 2 * i, 3, "%02x", random[i]);
+    }
+    
+    // Written under a temporary name, so workers never see half a job
+    job_path(id, ".new", path);
+    job_path(id, ".queued", queued);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || write_all(fd, request, strlen(request)) < 0 || close(fd) < 0 || rename(path, queued) < 0) {
+        perror("submit job");
+        unlink(path);
+        send(client_socket, "Error: cannot queue job", 23, 0);
+        return;
+    }
+    
+    char request_json[LOG_LINE_MAX];
+    log_event(LOG_INFO, "job_queued", "\"job\":\"%s\",\"command\":%s", id, json_str(request_json, sizeof(request_json), request));
+    snprintf(reply, sizeof(reply), "JOB %s queued", id);
+    send(client_socket, reply, strlen(reply), 0);
+}
+
+// "JOB <id> <state> [bytes | reason]"
+void job_status_reply(int client_socket, char *id) {
+    char detail[MAX_BUFFER];
+    char reply[MAX_PATH];
+    char path[MAX_PATH];
+    struct stat st;
+    
+    char *state = valid_job_id(id) ? job_state(id, detail, sizeof(detail)) : NULL;
+    if (state == NULL) {
+        snprintf(reply, sizeof(reply), "JOB %.*s unknown", MAX_JOB_ID, id);
+    } else if (strcmp(state, "done") == 0) {
+        job_path(id, ".tar.gz", path);
+        snprintf(reply, sizeof(reply), "JOB %s done %ld", id, stat(path, &st) == 0 ? (long)st.st_size : 0L);
+    } else if (strcmp(state, "failed") == 0) {
+        snprintf(reply, sizeof(reply), "JOB %s failed %.200s", id, detail);
+    } else {
+        snprintf(reply, sizeof(reply), "JOB %s %s", id, state);
+    }
+    send(client_socket, reply, strlen(reply), 0);
+}
+
+// A finished job's archive goes out like any other (delta, descriptor
+// passing, "Not modified"); any other state is reported instead
+void fetch_job(int client_socket, char *id) {
+    char tag[MAX_BUFFER];
+    char archive[MAX_PATH];
+    
+    char *state = valid_job_id(id) ? job_state(id, tag, sizeof(tag)) : NULL;
+    if (state == NULL || strcmp(state, "done") != 0) {
+        job_status_reply(client_socket, id);
+        return;
+    }
+    
+    tag[strcspn(tag, " \n")] = '\0';
+    if (strcmp(tag, request_opts.if_none_match) == 0) {
+        char not_modified[64];
+        snprintf(not_modified, sizeof(not_modified), "Not modified %.*s", MAX_TAG - 1, tag);
+        send(client_socket, not_modified, strlen(not_modified), 0);
+        return;
+    }
+    
+    job_path(id, ".tar.gz", archive);
+    send_archive_file(client_socket, archive, tag);
+}
+
+// A queued job is cancelled on the spot; a running one is asked to stop
+// and its worker notices at the next file or directory
+void cancel_job(int client_socket, char *id) {
+    char queued[MAX_PATH], cancelled[MAX_PATH], marker[MAX_PATH];
+    char detail[MAX_BUFFER];
+    char reply[64];
+    
+    if (!valid_job_id(id)) {
+        job_status_reply(client_socket, id);
+        return;
+    }
+    
+    job_path(id, ".queued", queued);
+    job_path(id, ".cancelled", cancelled);
+    if (rename(queued, cancelled) == 0) {
+        snprintf(reply, sizeof(reply), "JOB %s cancelled", id);
+        send(client_socket, reply, strlen(reply), 0);
+        return;
+    }
+    
+    char *state = job_state(id, detail, sizeof(detail));
+    if (state != NULL && strcmp(state, "running") == 0) {
+        job_path(id, ".cancel", marker);
+        close(open(marker, O_WRONLY | O_CREAT, 0600));
+        snprintf(reply, sizeof(reply), "JOB %s cancelling", id);
+        send(client_socket, reply, strlen(reply), 0);
+        return;
+    }
+    job_status_reply(client_socket, id);
+}
+
+void reap_children() {
+    pid_t pid;
+    
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < max_job_workers; i++) {
+            if (job_workers[i] == pid) {
+                job_workers[i] = 0;
+            }
+        }
+    }
+}
+
+// Called from the accept loop: start queued jobs, oldest first, while
+// worker slots are free. Each worker is forked with the live index.
+void dispatch_jobs(int server_fd, int unix_fd) {
+    reap_children();
+    if (time(NULL) - last_spool_sweep >= 60) {
+        sweep_spool();
+    }
+    
+    for (int slot = 0; slot < max_job_workers; slot++) {
+        if (job_workers[slot] != 0) {
+            continue;
+        }
+        
+        DIR *dir = opendir(spool_dir);
+        if (dir == NULL) {
+            return;
+        }
+        char id[MAX_JOB_ID + 1] = "";
+        time_t oldest = 0;
+        struct dirent *entry;
+        struct stat st;
+        char path[MAX_PATH];
+        while ((entry = readdir(dir)) != NULL) {
+            char *dot = strrchr(entry->d_name, '.');
+            if (dot == NULL || strcmp(dot, ".queued") != 0 || dot - entry->d_name > MAX_JOB_ID) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", spool_dir, entry->d_name);
+            if (stat(path, &st) == 0 && (id[0] == '\0' || st.st_mtime < oldest)) {
+                snprintf(id, sizeof(id), "%.*s", (int)(dot - entry->d_name), entry->d_name);
+                oldest = st.st_mtime;
+            }
+        }
+        closedir(dir);
+        if (id[0] == '\0') {
+            return;
+        }
+        
+        // Claim it; the other server's dispatcher may have been faster
+        char queued[MAX_PATH], running[MAX_PATH];
+        job_path(id, ".queued", queued);
+        job_path(id, ".running", running);
+        if (rename(queued, running) < 0) {
+            continue;
+        }
+        
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(server_fd);
+            if (unix_fd >= 0) close(unix_fd);
+            
+            // Written before the job runs, so run_job's cleanup always
+            // comes after it, however short the job
+            char pid_text[32];
+            job_path(id, ".pid", path);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd >= 0) {
+                write_all(fd, pid_text, snprintf(pid_text, sizeof(pid_text), "%d", (int)getpid()));
+                close(fd);
+            }
+            run_job(id);
+            exit(0);
+        }
+        if (pid < 0) {
+            perror("fork job worker");
+            rename(running, queued);
+            return;
+        }
+        
+        job_workers[slot] = pid;
+        log_event(LOG_INFO, "job_started", "\"job\":\"%s\",\"worker\":%d", id, (int)pid);
+    }
+}
+
+// Finished jobs and their archives are kept for FS_JOB_TTL seconds. A pid
+// file outlives its job only if the worker died; job_state fails such a job.
+void sweep_spool() {
+    DIR *dir = opendir(spool_dir);
+    struct dirent *entry;
+    struct stat st;
+    char path[MAX_PATH];
+    char id[MAX_JOB_ID + 1], detail[MAX_BUFFER];
+    time_t now = time(NULL);
+    
+    last_spool_sweep = now;
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char *dot = strrchr(entry->d_name, '.');
+        if (dot != NULL && strcmp(dot, ".pid") == 0 && dot - entry->d_name <= MAX_JOB_ID) {
+            snprintf(id, sizeof(id), "%.*s", (int)(dot - entry->d_name), entry->d_name);
+            char *state = job_state(id, detail, sizeof(detail));
+            if (state == NULL || strcmp(state, "running") != 0) {
+                job_path(id, ".pid", path);
+                unlink(path);
+            }
+            continue;
+        }
+        if (dot == NULL || strcmp(dot, ".queued") == 0 || strcmp(dot, ".running") == 0 ||
+            strcmp(dot, ".pid") == 0 || strcmp(dot, ".partial") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", spool_dir, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime >= job_ttl) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Job worker: run the queued command with send_archive redirected into
+// the spool, then move the job to its final state
+void run_job(char *id) {
+    char request[MAX_BUFFER];
+    char path[MAX_PATH], partial[MAX_PATH], archive[MAX_PATH];
+    
+    job_path(id, ".running", path);
+    int fd = open(path, O_RDONLY);
+    ssize_t n = fd >= 0 ? read(fd, request, sizeof(request) - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (n <= 0) {
+        finish_job(id, "failed", "unreadable job");
+        return;
+    }
+    request[n] = '\0';
+    
+    // Same option lines as a direct request; the deadline counts from now
+    parse_request_options(request);
+    begin_request(-1);
+    job_path(id, ".cancel", job_cancel_path);
+    job_path(id, ".partial", partial);
+    job_path(id, ".tar.gz", archive);
+    job_archive = partial;
+    job_status = 1;
+    char request_json[LOG_LINE_MAX];
+    log_event(LOG_DEBUG, "job_running", "\"job\":\"%s\",\"command\":%s", id, json_str(request_json, sizeof(request_json), request));
+    
+    run_archive_command(-1, request);
+    
+    if (cancel_reason == CANCEL_JOB) {
+        unlink(partial);
+        finish_job(id, "cancelled", "cancelled");
+    } else if (job_status == 0 && rename(partial, archive) == 0) {
+        finish_job(id, "done", job_tag);
+    } else {
+        unlink(partial);
+        finish_job(id, "failed", cancel_reason == CANCEL_DEADLINE ? "deadline exceeded" :
+                   job_status > 0 ? "no file found" : "archive build failed");
+    }
+    
+    unlink(job_cancel_path);
+    job_path(id, ".pid", path);
+    unlink(path);
+    log_event(LOG_INFO, "job_finished", "\"job\":\"%s\",\"latency_ms\":%ld", id, monotonic_ms() - request_started_ms);
+}
+
+// Leave the running state: the text is written first and the rename
+// publishes it, so readers never see a final state without its detail
+void finish_job(char *id, char *state, char *text) {
+    char running[MAX_PATH], final[MAX_PATH], suffix[16];
+    
+    job_path(id, ".running", running);
+    snprintf(suffix, sizeof(suffix), ".%s", state);
+    job_path(id, suffix, final);
+    
+    int fd = open(running, O_WRONLY | O_TRUNC);
+    if (fd < 0) {
+        return;  // already finished
+    }
+    write_all(fd, text, strlen(text));
+    close(fd);
+    rename(running, final);
+}
+
+int compare_shard_members(const void *a, const void *b) {
+    return strcmp(((struct shard_member *)a)->path, ((struct shard_member *)b)->path);
+}
+
+// Keep this node's share of a result every node computes alike from its
+// own index: members ordered by path are cut into shard_count runs of about
+// equal bytes, so each shard is a contiguous file range and the shards
+// concatenate in path order. Returns the new count.
+int select_shard(int *files, int count) {
+    struct shard_member *members = malloc(sizeof(struct shard_member) * count);
+    long total = 0, offset = 0;
+    int kept = 0;
+    
+    if (members == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        index_entry_path(files[i], members[i].path);
+        members[i].id = files[i];
+        members[i].size = file_index.entries[files[i]].size;
+        total += members[i].size;
+    }
+    qsort(members, count, sizeof(struct shard_member), compare_shard_members);
+    
+    for (int i = 0; i < count; i++) {
+        // A member belongs to the shard its first byte falls in; empty
+        // files are spread by position instead
+        int shard = total > 0
+            ? (int)((double)offset * request_opts.shard_count / total)
+            : i * request_opts.shard_count / count;
+        if (shard >= request_opts.shard_count) {
+            shard = request_opts.shard_count - 1;
+        }
+        if (shard == request_opts.shard_index) {
+            files[kept++] = members[i].id;
+        }
+        offset += members[i].size;
+    }
+    free(members);
+    
+    // Only the last shard ends the archive, so the shards can be joined
+    request_opts.open_ended = request_opts.shard_index < request_opts.shard_count - 1;
+    log_event(LOG_DEBUG, "shard", "\"shard\":%d,\"shards\":%d,\"files\":%d,\"of\":%d",
+              request_opts.shard_index + 1, request_opts.shard_count, kept, count);
+    return kept;
+}
+
+void request_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+// Shared memory a reloaded server can take over: a POSIX shared memory
+// object unlinked right away, so only its descriptor (passed to the new
+// server in env) keeps it alive. Sets *reused when the old server's object
+// was mapped; one of another size has another layout and is dropped.
+void *map_shared(char *env, size_t size, int *fd, int *reused) {
+    char *value = getenv(env);
+    struct stat st;
+    char name[64];
+    
+    *reused = 0;
+    if (value != NULL) {
+        *fd = atoi(value);
+        unsetenv(env);
+        if (fstat(*fd, &st) == 0 && st.st_size == (off_t)size) {
+            void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+            if (mem != MAP_FAILED) {
+                fcntl(*fd, F_SETFD, FD_CLOEXEC);
+                *reused = 1;
+                return mem;
+            }
+        }
+        close(*fd);
+    }
+    
+    snprintf(name, sizeof(name), "/fileserver.%d.%s", (int)getpid(), env);
+    *fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (*fd >= 0) {
+        shm_unlink(name);
+    }
+    if (*fd < 0 || ftruncate(*fd, size) < 0) {
+        // Still works, it just starts cold after a reload
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+}
+
+// Let fd survive exec and tell the new server its number
+void export_fd(char *name, int fd) {
+    char value[16];
+    
+    if (fd < 0) {
+        return;
+    }
+    fcntl(fd, F_SETFD, 0);
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(name, value, 1);
+}
+
+// SIGHUP: exec the binary again with our listeners and shared memory. It
+// runs as a grandchild so that draining, which waits for all our
+// children, does not wait for it; it reports on a pipe once its index is
+// built, and until then we keep accepting.
+void start_successor(int server_fd, int unix_fd) {
+    int ready[2];
+    
+    if (successor_fd >= 0) {
+        return;
+    }
+    if (self_path[0] == '\0' || pipe(ready) < 0) {
+        log_event(LOG_ERROR, "reload_failed", "\"reason\":\"cannot start a new server\"");
+        return;
+    }
+    
+    // Both servers accept from the same queue while they overlap, so a
+    // wakeup may find the connection already taken
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    if (unix_fd >= 0) {
+        fcntl(unix_fd, F_SETFL, fcntl(unix_fd, F_GETFL) | O_NONBLOCK);
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() != 0) {
+            _exit(0);
+        }
+        char value[32];
+        close(ready[0]);
+        snprintf(value, sizeof(value), "%d,%d", server_fd, unix_fd);
+        setenv("FS_LISTEN_FDS", value, 1);
+        export_fd("FS_READY_FD", ready[1]);
+        export_fd("FS_SHARED_FD", shared_fd);
+        export_fd("FS_MEMBER_CACHE_FD", member_cache_fd);
+        execl(self_path, self_path, (char *)NULL);
+        perror("exec");
+        _exit(127);
+    }
+    
+    close(ready[1]);
+    if (pid < 0) {
+        perror("fork failed");
+        close(ready[0]);
+        return;
+    }
+    waitpid(pid, NULL, 0);
+    successor_fd = ready[0];
+    char path_json[LOG_LINE_MAX];
+    log_event(LOG_INFO, "reload_started", "\"binary\":%s", json_str(path_json, sizeof(path_json), self_path));
+}
+
+// Started by a reload: tell the old server we are accepting now
+void announce_ready() {
+    char *value = getenv("FS_READY_FD");
+    
+    if (value == NULL) {
+        return;
+    }
+    int fd = atoi(value);
+    unsetenv("FS_READY_FD");
+    if (write(fd, "R", 1) != 1) {
+        perror("ready pipe");
+    }
+    close(fd);
+}
+
+// The ready pipe became readable: either the new server took over, and we
+// stop accepting, let the sessions and jobs we started finish and exit, or
+// it died first and we carry on
+void handle_successor(int server_fd, int unix_fd) {
+    char status = 0;
+    pid_t pid;
+    
+    if (read(successor_fd, &status, 1) != 1 || status != 'R') {
+        log_event(LOG_ERROR, "reload_failed", "\"reason\":\"the new server exited before it was ready\"");
+        close(successor_fd);
+        successor_fd = -1;
+        return;
+    }
+    
+    close(server_fd);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+    }
+    log_event(LOG_INFO, "reload_draining", "");
+    while ((pid = waitpid(-1, NULL, 0)) > 0 || (pid < 0 && errno == EINTR)) {
+    }
+    log_event(LOG_INFO, "reload_drained", "");
+    exit(0);
+}
+
+// Register this process's transfer so others can work out their share.
+// Local clients don't cross the network and are never paced.
+void begin_transfer() {
+    if (client_is_local) {
+        return;
+    }
+    
+    pthread_mutex_lock(&shared->lock);
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        // Reclaim slots of sessions that died mid-transfer
+        pid_t pid = shared->transfers[i].pid;
+        if (pid == 0 || (kill(pid, 0) < 0 && errno == ESRCH)) {
+            shared->transfers[i].pid = getpid();
+            shared->transfers[i].addr = client_addr;
+            transfer_index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+    
+    pace_tokens = 0;
+    pace_last_ms = monotonic_ms();
+    pace_checked_ms = 0;
+}
+
+void end_transfer() {
+    if (transfer_index < 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&shared->lock);
+    shared->transfers[transfer_index].pid = 0;
+    pthread_mutex_unlock(&shared->lock);
+    transfer_index = -1;
+}
+
+// Bytes/s this transfer may use right now, 0 for unlimited: the
+// per-connection limit, an equal part of its client's per-address limit,
+// and an equal part of its client's equal share of the total. Shares go
+// to client addresses first, so opening more connections gains nothing.
+long transfer_rate() {
+    int clients = 0, mine = 0;
+    long rate = 0;
+    
+    pthread_mutex_lock(&shared->lock);
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (shared->transfers[i].pid == 0) {
+            continue;
+        }
+        in_addr_t addr = shared->transfers[i].addr;
+        if (addr == client_addr) {
+            mine++;
+        }
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = shared->transfers[j].pid != 0 && shared->transfers[j].addr == addr;
+        }
+        if (!seen) {
+            clients++;
+        }
+    }
+    long conn = shared->rate_conn, ip = shared->rate_ip, total = shared->rate_total;
+    pthread_mutex_unlock(&shared->lock);
+    
+    // Unregistered (table full): count as one more transfer of our own
+    if (transfer_index < 0) {
+        if (mine == 0) clients++;
+        mine++;
+    }
+    
+    if (conn > 0) {
+        rate = conn;
+    }
+    if (ip > 0 && (rate == 0 || ip / mine < rate)) {
+        rate = ip / mine;
+    }
+    if (total > 0 && (rate == 0 || total / clients / mine < rate)) {
+        rate = total / clients / mine;
+    }
+    // Never stall a transfer outright
+    return rate > 0 && rate < 1024 ? 1024 : rate;
+}
+
+// Called before sending bytes: sleep until the bucket covers them. The
+// rate is rechecked every RATE_RECHECK_MS, so shares follow transfers
+// starting and finishing; idle time earns at most RATE_BURST_MS of credit.
+void pace_transfer(long bytes) {
+    request_bytes += bytes;
+    if (client_is_local) {
+        return;
+    }
+    
+    long now = monotonic_ms();
+    if (now - pace_checked_ms >= RATE_RECHECK_MS) {
+        pace_rate = transfer_rate();
+        pace_checked_ms = now;
+    }
+    if (pace_rate <= 0) {
+        pace_tokens = 0;
+        pace_last_ms = now;
+        return;
+    }
+    
+    pace_tokens += (now - pace_last_ms) * pace_rate / 1000;
+    pace_last_ms = now;
+    if (pace_tokens > pace_rate * RATE_BURST_MS / 1000) {
+        pace_tokens = pace_rate * RATE_BURST_MS / 1000;
+    }
+    
+    pace_tokens -= bytes;
+    if (pace_tokens < 0) {
+        usleep(-pace_tokens * 1000000 / pace_rate);
+    }
+}
+
+// "ratelimit" shows the limits and active transfers; "ratelimit <conn>
+// <ip> <total>" (KB/s, 0 for unlimited) sets them, from this host only
+void send_rate_limits(int client_socket, char *buffer) {
+    char reply[256];
+    long conn, ip, total;
+    int transfers = 0;
+    
+    if (sscanf(buffer, "ratelimit %ld %ld %ld", &conn, &ip, &total) == 3) {
+        if (!client_is_local) {
+            char *error = "Error: rate limits can only be changed over the local socket";
+            send(client_socket, error, strlen(error), 0);
+            return;
+        }
+        if (conn < 0 || ip < 0 || total < 0) {
+            send(client_socket, "Error: rate limits must be non-negative", 39, 0);
+            return;
+        }
+        pthread_mutex_lock(&shared->lock);
+        shared->rate_conn = conn * 1024;
+        shared->rate_ip = ip * 1024;
+        shared->rate_total = total * 1024;
+        pthread_mutex_unlock(&shared->lock);
+        log_event(LOG_INFO, "rate_limits", "\"conn_kbps\":%ld,\"ip_kbps\":%ld,\"total_kbps\":%ld", conn, ip, total);
+    }
+    
+    pthread_mutex_lock(&shared->lock);
+    conn = shared->rate_conn / 1024;
+    ip = shared->rate_ip / 1024;
+    total = shared->rate_total / 1024;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        transfers += shared->transfers[i].pid != 0;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    
+    snprintf(reply, sizeof(reply),
+             "Rate limits (KB/s, 0 is unlimited): per connection %ld, per client %ld, total %ld. "
+             "%d transfer%s active",
+             conn, ip, total, transfers, transfers == 1 ? "" : "s");
+    send(client_socket, reply, strlen(reply), 0);
+}
+
+// Map the log ring and start its writer. The writer is a grandchild, so
+// reaping and reload draining never wait for it; it outlives us only long
+// enough to write what is left.
+void init_logging() {
+    char *level = getenv("FS_LOG_LEVEL");
+    
+    if (level != NULL) {
+        log_level = strcmp(level, "debug") == 0 ? LOG_DEBUG :
+                    strcmp(level, "warn") == 0 ? LOG_WARN :
+                    strcmp(level, "error") == 0 ? LOG_ERROR : LOG_INFO;
+    }
+    log_sample = config_int("FS_LOG_SAMPLE", 1);
+    
+    struct log_ring *ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap log ring");
+        return;
+    }
+    for (unsigned long i = 0; i < LOG_RING_SLOTS; i++) {
+        ring->slots[i].seq = i;
+    }
+    
+    pid_t owner = getpid();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            close_inherited_fds();
+            log_ring = ring;
+            run_log_writer(owner);
+        }
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork log writer");
+        munmap(ring, sizeof(struct log_ring));
+        return;
+    }
+    waitpid(pid, NULL, 0);
+    log_ring = ring;
+}
+
+// Copy lines to stdout in ticket order, flushing whenever the ring runs
+// dry. Exits once the server is gone and nothing has arrived for a while.
+void run_log_writer(pid_t owner) {
+    unsigned long tail = 0, reported = 0;
+    long idle_since = monotonic_ms();     // last line written
+    long pending_since = idle_since;      // since then or since last seen empty
+    
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    while (1) {
+        struct log_slot *slot = &log_ring->slots[tail % LOG_RING_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail + 1) {
+            fwrite(slot->line, 1, slot->len, stdout);
+            __atomic_store_n(&slot->seq, tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+            tail++;
+            idle_since = pending_since = monotonic_ms();
+            continue;
+        }
+        
+        unsigned long dropped = __atomic_load_n(&log_ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            printf("{\"level\":\"warn\",\"node\":\"%s\",\"event\":\"log_dropped\",\"lines\":%lu}\n",
+                   LOG_NODE, dropped - reported);
+            reported = dropped;
+        }
+        fflush(stdout);
+        
+        long now = monotonic_ms();
+        if (__atomic_load_n(&log_ring->head, __ATOMIC_RELAXED) == tail) {
+            pending_since = now;
+            if (now - idle_since >= LOG_LINGER_MS && kill(owner, 0) < 0 && errno == ESRCH) {
+                _exit(0);
+            }
+        } else if (now - pending_since >= LOG_LINGER_MS) {
+            // A producer that took a ticket and died never publishes its
+            // line; skip the slot rather than stall every later line. The
+            // exchange fails if the line was published after all.
+            unsigned long expected = tail;
+            if (__atomic_compare_exchange_n(&slot->seq, &expected, tail + LOG_RING_SLOTS, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                tail++;
+                idle_since = pending_since = now;
+            }
+        }
+        usleep(LOG_DRAIN_US);
+    }
+}
+
+// Queue one JSON line: {"ts", "level", "node", "pid", "event", fields...}.
+// format expands to further "key":value pairs; string values go through
+// json_str. Never blocks: with the ring full the line is dropped.
+void log_event(int level, char *event, char *format, ...) {
+    static char *level_names[] = {"debug", "info", "warn", "error"};
+    char line[LOG_LINE_MAX];
+    int sampled = level & LOG_SAMPLED;
+    struct timespec now;
+    struct tm tm;
+    
+    level &= ~LOG_SAMPLED;
+    if (level < log_level) {
+        return;
+    }
+    if (sampled && level < LOG_WARN && log_sample > 1 && log_ring != NULL &&
+        __atomic_fetch_add(&log_ring->sampled, 1, __ATOMIC_RELAXED) % log_sample != 0) {
+        return;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    int len = snprintf(line, sizeof(line),
+                       "{\"ts\":\"%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ\",\"level\":\"%s\","
+                       "\"node\":\"%s\",\"pid\":%d,\"event\":\"%s\"",
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                       now.tv_nsec / 1000000, level_names[level], LOG_NODE, (int)getpid(), event);
+    
+    if (format[0] != '\0') {
+        // Room is kept for "}\n"; fields that don't fit are left out whole
+        int room = sizeof(line) - len - 3;
+        va_list args;
+        va_start(args, format);
+        line[len] = ',';
+        int n = vsnprintf(line + len + 1, room, format, args);
+        va_end(args);
+        if (n >= 0 && n < room) {
+            len += 1 + n;
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, ",\"truncated\":true");
+        }
+    }
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+    log_write(line, len);
+}
+
+// Claim the next slot with a compare-and-swap on head; the writer frees
+// slots by advancing their seq a lap ahead
+void log_write(char *line, int len) {
+    if (log_ring == NULL) {
+        fwrite(line, 1, len, stdout);
+        fflush(stdout);
+        return;
+    }
+    
+    unsigned long pos = __atomic_load_n(&log_ring->head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    while (1) {
+        slot = &log_ring->slots[pos % LOG_RING_SLOTS];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    
+    // Too late if the writer gave up on us and skipped the slot; its seq
+    // already belongs to the next lap, so the line is dropped instead
+    unsigned long expected = pos;
+    if (!__atomic_compare_exchange_n(&slot->seq, &expected, pos + 1, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&log_ring->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// The writer outlives reloads: keep only stdout/stderr, so it holds no
+// listener, ready pipe or shared memory of the server that started it
+void close_inherited_fds() {
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry;
+    
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        if (entry->d_name[0] != '.' && fd != STDOUT_FILENO && fd != STDERR_FILENO && fd != dirfd(dir)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+// value as a quoted JSON string, cut short to fit size
+char *json_str(char *out, size_t size, char *value) {
+    size_t len = 0;
+    
+    out[len++] = '"';
+    for (unsigned char *p = (unsigned char *)value; *p && len + 8 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[len++] = '\\';
+            out[len++] = *p;
+        } else if (*p == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else if (*p < 0x20) {
+            len += snprintf(out + len, size - len, "\\u%04x", *p);
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len++] = '"';
+    out[len] = '\0';
+    return out;
+}
+
+// The per-request line: command (option lines included), outcome, time
+// since it arrived and archive bytes sent
+void log_request(char *outcome) {
+    char command[LOG_LINE_MAX / 2];
+    
+    log_event(LOG_INFO | LOG_SAMPLED, "request",
+              "\"command\":%s,\"outcome\":\"%s\",\"latency_ms\":%ld,\"bytes\":%ld",
+              json_str(command, sizeof(command), raw_request), outcome,
+              monotonic_ms() - request_started_ms, request_bytes);
+}
+
+void *run_indexer(void *home_path) {
+    build_file_index(home_path);
+    __atomic_store_n(&indexer_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Called from the accept loop: swap in a finished rebuild, or start one
+// on the indexer thread once the live index is stale
+void refresh_file_index(char *home_path) {
+    if (indexer_running) {
+        if (!__atomic_load_n(&indexer_done, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        pthread_join(indexer, NULL);
+        indexer_running = 0;
+        swap_file_index();
+        log_event(LOG_DEBUG, "index_refreshed", "\"files\":%d", file_index.count);
+        return;
+    }
+    if (time(NULL) - file_index.built_at < INDEX_REFRESH_INTERVAL) {
+        return;
+    }
+    
+    // Signals are left to the accept loop, whose poll they must interrupt
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    indexer_done = 0;
+    if (pthread_create(&indexer, NULL, run_indexer, home_path) == 0) {
+        indexer_running = 1;
+    } else {
+        perror("pthread_create indexer");
+        build_file_index(home_path);
+        swap_file_index();
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}